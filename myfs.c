@@ -1,36 +1,280 @@
+#define _GNU_SOURCE   /* SEEK_DATA / SEEK_HOLE */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <fnmatch.h>
 
 /* Constants */
 #define FAT_ENTRIES   4096
-#define FILE_ENTRIES  128
 #define BLOCK_SIZE    512
+#define NAME_LEN      128    /* one path component, with its NUL */
+#define PATH_LEN      1024
+#define MAX_MEMBERS   16     /* images in a striped volume */
+
+/* Block-device ioctl from <linux/fs.h> (which has its own BLOCK_SIZE) */
+#ifndef BLKDISCARD
+#define BLKDISCARD    _IO(0x12, 119)
+#endif
+#ifndef BLKSSZGET
+#define BLKSSZGET     _IO(0x12, 104)
+#endif
+
+/* Region boundaries used for locking */
+#define DATA_OFFSET      ((off_t)(FAT_ENTRIES * sizeof(uint32_t)))
+#define META_END         (DATA_OFFSET + BLOCK_SIZE)   /* FAT + superblock */
+
+/* FAT markers (bit 31 set) */
+#define FAT_EOC       0xFFFFFFFF   /* last data block of a file */
+#define FAT_SNAPSHOT  0xFFFFFFFD   /* free in the live FAT but still referenced by a snapshot */
+
+/*
+ * Sparse files: runs of all-zero blocks (holes) take no space. A FAT link is
+ *   next data block (bits 0-15) | number of hole blocks before it (bits 16-30)
+ * and a directory entry's first block uses the same encoding for leading
+ * holes. Holes after the last data block are implied by the file size; a
+ * file without any data block has first block FAT_EOC.
+ */
+#define LINK_BLOCK(e)          ((e) & 0xFFFF)
+#define LINK_HOLES(e)          (((e) >> 16) & 0x7FFF)
+#define MAKE_LINK(blk, holes)  ((uint32_t)(blk) | ((uint32_t)(holes) << 16))
+#define MAX_HOLE_RUN           0x7FFF
+
+/*
+ * Superblock: stored in data block 0, which FAT[0] keeps reserved.
+ * Holds the root directory and the snapshot table; each snapshot is a
+ * chain of blocks containing a frozen copy of the FAT followed by every
+ * path on the image (see LoadSnapshot).
+ */
+#define SB_MAGIC       0x5346594D   /* "MYFS" */
+#define MAX_SNAPSHOTS  8
+#define SNAP_NAME_LEN  48
+
+struct Snapshot {
+    char     name[SNAP_NAME_LEN];
+    uint32_t metaBlock;   // first block of the frozen FAT + path records
+    uint32_t created;     // time the snapshot was taken
+};
+
+struct Superblock {
+    uint32_t        magic;
+    uint32_t        snapCount;
+    struct Snapshot snaps[MAX_SNAPSHOTS];
+    uint32_t        rootDir;     // root node of the root directory (0 = empty)
+    uint32_t        tailBlock;   // tail block new tails are packed into (0 = none)
+    /* Space accounting (see StoreFAT), answered by -df without a FAT scan */
+    uint32_t        counted;     // counters below are valid (set by -format / -check)
+    uint32_t        freeBlocks;  // FAT entries that are free
+    uint32_t        usedBlocks;  // ... that hold files, directories, tails or snapshots
+    uint32_t        largestFree; // longest run of free blocks
+    uint32_t        fileCount;
+    uint32_t        dirCount;
+    /* Volume geometry (0 members = a single image), see OpenVolume */
+    uint32_t        members;
+    uint32_t        stripeBlocks;
+    uint32_t        pinnedBlock; // bitmap of the blocks snapshots pin (0 = walk them), see LoadPinned
+    uint8_t         reserved[BLOCK_SIZE - 52 - MAX_SNAPSHOTS * sizeof(struct Snapshot)];
+};
+_Static_assert(sizeof(struct Superblock) == BLOCK_SIZE,
+               "superblock must fill data block 0 exactly: adjust reserved[] when adding fields");
+
+/*
+ * Directories are B+trees of entries ordered by name (see "Directories").
+ * A directory's firstBlock is the root node of its own tree (0 = empty).
+ *
+ * Small files take no block of their own: up to INLINE_MAX bytes are kept
+ * in the entry itself, and otherwise a last partial block of up to TAIL_MAX
+ * bytes is packed into a tail block shared with other files (see "Tail
+ * blocks"). The chain then only holds the full blocks before it.
+ */
+#define DIRENT_DIR     0x01
+#define DIRENT_INLINE  0x02   /* data in the entry, no blocks */
+#define DIRENT_TAIL    0x04   /* last partial block in a tail block */
+#define INLINE_MAX     60
+#define TAIL_MAX       (BLOCK_SIZE / 2)
+
+struct DirEntry {
+    char     name[NAME_LEN];
+    uint8_t  flags;
+    uint32_t firstBlock;
+    uint32_t size;
+    uint32_t tailBlock;          // DIRENT_TAIL: block holding the tail ...
+    uint16_t tailOff;            // ... at this byte offset (size % BLOCK_SIZE bytes)
+    char     data[INLINE_MAX];   // DIRENT_INLINE: the file's contents
+};
+
+/* An entry anywhere in the tree, with its full path */
+struct PathEntry {
+    char           *path;
+    int             depth;    // 0 = in the root directory
+    struct DirEntry e;
+};
+
+/* A directory being changed, and where its root node is recorded */
+struct DirRef {
+    uint32_t root;
+    uint32_t origRoot;
+    int      isRoot;           // the root directory: recorded in the superblock
+    uint32_t parentRoot;       // otherwise: in this directory's entry ...
+    char     name[NAME_LEN];   // ... under this name
+};
+
+/* Trace file (--trace): magic, then records flagged with these bits */
+#define TRACE_MAGIC     "MYFSTRC1"
+#define TRACE_BUFFERED  0x01   /* -write/-append line buffered by -batch */
+#define TRACE_DISCARD   0x02   /* ran with --discard */
+#define TRACE_FAILED    0x04   /* command exited with an error */
 
 /*── Function prototypes ────────────────────*/
 void Format(const char *disk_path);
 void Write(const char *disk_path, const char *srcPath, const char *destFileName);
 void Read(const char *disk_path, const char *srcFileName, const char *destPath);
 void Delete(const char *disk_path, const char *filename);
-void List(const char *disk_path);
-void Sort(const char *disk_path);
+void List(const char *disk_path, const char *dirPath);
+void Sort(const char *disk_path, const char *dirPath);
 void RenameFile(const char *disk_path, const char *srcFileName, const char *newFileName);
 void Duplicate(const char *disk_path, const char *srcFileName);
 void Search(const char *disk_path, const char *srcFileName);
+void Find(const char *disk_path, const char *pattern);
 void Hide(const char *disk_path, const char *srcFileName);
 void Unhide(const char *disk_path, const char *srcFileName);
+void MakeDir(const char *disk_path, const char *dirPath);
+void RemoveDir(const char *disk_path, const char *dirPath);
 void PrintFileList(const char *disk_path);
 void PrintFAT(const char *disk_path);
 void Defragment(const char *disk_path);
+void Snapshot(const char *disk_path, const char *snapName);
+void Rollback(const char *disk_path, const char *snapName);
+void ListSnapshots(const char *disk_path);
+void DropSnapshot(const char *disk_path, const char *snapName);
+void Append(const char *disk_path, const char *srcPath, const char *destFileName);
+void SyncImage(const char *disk_path);
+void SyncFile(const char *disk_path, const char *srcPath, const char *destFileName);
+void Batch(const char *disk_path, const char *scriptPath);
+void DiskFree(const char *disk_path);
+void Stat(const char *disk_path, const char *name);
+void Check(const char *disk_path);
+static int RunCommand(int argc, char *argv[]);
+static void LockRegion(FILE *disk, short type, off_t start, off_t len);
+static void LoadSuperblock(FILE *disk, struct Superblock *sb);
+static void StoreSuperblock(FILE *disk, const struct Superblock *sb);
+static void StoreFAT(FILE *disk, const uint32_t *fat, struct Superblock *sb);
+static void LoadPinned(FILE *disk, const uint32_t *fat, const struct Superblock *sb, uint8_t *pinned);
+static void ScanPinned(FILE *disk, const uint32_t *fat, const struct Superblock *sb, uint8_t *pinned);
+static void StorePinned(FILE *disk, uint32_t *fat, struct Superblock *sb, uint8_t *pinned);
+static void ApplyPinned(uint32_t *fat, const uint8_t *pinned);
+static int LoadChain(const uint32_t *fat, uint32_t firstBlock, uint32_t *blocks, uint32_t *holes);
+static int IsZeroBlock(const char *buf, size_t len);
+static void ReleaseBlocks(FILE *disk, uint32_t first, uint32_t count);
+static void ReleaseBlockList(FILE *disk, uint32_t *blocks, int n);
+static int ScanSource(int src, off_t filesize, uint8_t **isDataOut, char **dataOut);
+static uint32_t ExtentBlocks(int src, off_t filesize);
+static void TraceBegin(int argc, char *argv[], int flags);
+static void TraceEnd(int status);
+static void TracedFlush(const char *disk_path);
+int Replay(const char *tracefile, const char *disk_path);
+
+/* Options that may appear anywhere on the command line */
+static size_t bufferLimit   = 1 << 20;  /* --buffer-limit: buffered bytes before a flush */
+static int    flushInterval = 5;        /* --flush-interval: seconds buffered data may wait */
+static int    discardMode   = 0;        /* --discard: Format and Delete release freed blocks */
+static size_t stripeSize    = 64 << 10; /* --stripe: bytes per volume member in a row (-format) */
+static int    directMode    = 0;        /* --direct: O_DIRECT image I/O, bypassing the page cache */
+static const char *tracePath;           /* --trace: record commands to this file */
+static int    replayPaced;              /* --paced: myfs-replay keeps the recorded gaps */
+static int    replayFresh;              /* --fresh: myfs-replay formats the image first */
+static const char *replayFrom;          /* --from: myfs-replay rolls back to this snapshot first */
+static uint64_t findMin;                /* --min-size / --max-size: -find size range */
+static uint64_t findMax = UINT64_MAX;
+static int    findHidden;               /* -find: 0 visible files, 1 --hidden only, 2 --all */
+static const char *findSort;            /* --sort: -find order, e.g. "-size,name" */
+static int    findLimit;                /* --limit: -find prints the first N only */
+static int    findJson;                 /* --json: -find prints a JSON array */
+
+/* Parse a size such as 4096, 64K or 8M */
+static size_t ParseSize(const char *text) {
+    char *end;
+    size_t value = strtoull(text, &end, 10);
+    if (*end == 'K' || *end == 'k') value <<= 10;
+    else if (*end == 'M' || *end == 'm') value <<= 20;
+    else if (*end == 'G' || *end == 'g') value <<= 30;
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+    // Strip "--option value" arguments; what remains is <disk> <command> [args]
+    int n = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--buffer-limit") == 0 && i + 1 < argc)
+            bufferLimit = ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "--flush-interval") == 0 && i + 1 < argc)
+            flushInterval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--discard") == 0)
+            discardMode = 1;
+        else if (strcmp(argv[i], "--stripe") == 0 && i + 1 < argc)
+            stripeSize = ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "--direct") == 0)
+            directMode = 1;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (strcmp(argv[i], "--paced") == 0)
+            replayPaced = 1;
+        else if (strcmp(argv[i], "--fresh") == 0)
+            replayFresh = 1;
+        else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc)
+            replayFrom = argv[++i];
+        else if (strcmp(argv[i], "--min-size") == 0 && i + 1 < argc)
+            findMin = ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc)
+            findMax = ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "--hidden") == 0)
+            findHidden = 1;
+        else if (strcmp(argv[i], "--all") == 0)
+            findHidden = 2;
+        else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc)
+            findSort = argv[++i];
+        else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+            findLimit = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--json") == 0)
+            findJson = 1;
+        else
+            argv[n++] = argv[i];
+    }
+    argc = n;
+    argv[argc] = NULL;
+
+    // Installed as a link named myfs-replay: <trace> <disk>
+    const char *prog = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    if (strcmp(prog, "myfs-replay") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s <trace> <disk> [--paced] [--fresh | --from <snapshot>]\n", argv[0]);
+            return 1;
+        }
+        return Replay(argv[1], argv[2]);
+    }
 
-/* Dispatch based on argv */
-int main(int argc, char *argv[]) {  /* less argument than expected */
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <disk> <command> [args]\n", argv[0]);
+    if (argc < 3) {  /* less argument than expected */
+        fprintf(stderr, "Usage: %s <disk> <command> [args] [--options]\n", argv[0]);
         return 1;
     }
+    TraceBegin(argc, argv, 0);
+    int status = RunCommand(argc, argv);
+    TraceEnd(status);
+    return status;
+}
+
+/* Dispatch based on argv: argv[1] is the disk, argv[2] the command */
+static int RunCommand(int argc, char *argv[]) {
     const char *disk = argv[1];
     const char *cmd  = argv[2];
 
@@ -49,12 +293,20 @@ int main(int argc, char *argv[]) {  /* less argument than expected */
         Delete(disk, argv[3]);
     }
     
-    else if (strcmp(cmd, "-list") == 0 && argc == 3) {
-        List(disk);
+    else if (strcmp(cmd, "-list") == 0 && (argc == 3 || argc == 4)) {
+        List(disk, argc == 4 ? argv[3] : "");
+    }
+
+    else if (strcmp(cmd, "-sorta") == 0 && (argc == 3 || argc == 4)) {
+        Sort(disk, argc == 4 ? argv[3] : "");
+    }
+
+    else if (strcmp(cmd, "-mkdir") == 0 && argc == 4) {
+        MakeDir(disk, argv[3]);
     }
 
-    else if (strcmp(cmd, "-sorta") == 0 && argc == 3) {
-        Sort(disk);
+    else if (strcmp(cmd, "-rmdir") == 0 && argc == 4) {
+        RemoveDir(disk, argv[3]);
     }
 
     else if (strcmp(cmd, "-rename") == 0 && argc == 5) {
@@ -73,6 +325,10 @@ int main(int argc, char *argv[]) {  /* less argument than expected */
         Search(disk, argv[3]);
     }
 
+    else if (strcmp(cmd, "-find") == 0 && (argc == 3 || argc == 4)) {
+        Find(disk, argc == 4 ? argv[3] : NULL);
+    }
+
     else if (strcmp(cmd, "-unhide") == 0 && argc == 4) {
         Unhide(disk, argv[3]);
     }
@@ -89,864 +345,4668 @@ int main(int argc, char *argv[]) {  /* less argument than expected */
         Defragment(disk);
     }
 
-
-    else {
-        fprintf(stderr, "Unknown or malformed command\n");
-        return 1;
+    else if (strcmp(cmd, "-snapshot") == 0 && argc == 4) {
+        Snapshot(disk, argv[3]);
     }
 
-    return 0;
-}
-
-/* implement each function */
-
-/**
- * Format the disk image:
- *  - Zero out the FAT region, except entry[0] = 0xFFFFFFFF
- *  - Zero out the 128-entry file list (each 256 bytes)
- */
-void Format(const char *disk_path) {
-    FILE *fp = fopen(disk_path, "r+b");
-    if (!fp) {
-        perror("Error opening disk image");
-        exit(EXIT_FAILURE);
+    else if (strcmp(cmd, "-rollback") == 0 && argc == 4) {
+        Rollback(disk, argv[3]);
     }
 
-    // Make sure we start at the very beginning
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("fseek failed");
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    else if (strcmp(cmd, "-snapshots") == 0 && argc == 3) {
+        ListSnapshots(disk);
     }
 
-    // 1) Write the FAT
-    uint32_t entry;
-    // 1a) First entry = 0xFFFFFFFF
-    entry = 0xFFFFFFFF;
-    if (fwrite(&entry, sizeof(entry), 1, fp) != 1) {
-        perror("Failed to write FAT[0]");
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    else if (strcmp(cmd, "-dropsnapshot") == 0 && argc == 4) {
+        DropSnapshot(disk, argv[3]);
     }
 
-    // 1b) Remaining FAT entries = 0x00000000
-    entry = 0x00000000;
-    for (int i = 1; i < FAT_ENTRIES; i++) {
-        if (fwrite(&entry, sizeof(entry), 1, fp) != 1) {
-            perror("Failed to write FAT entry");
-            fclose(fp);
-            exit(EXIT_FAILURE);
-        }
+    else if (strcmp(cmd, "-append") == 0 && argc == 5) {
+        Append(disk, argv[3], argv[4]);
     }
 
-    // 2) Write the File List (128 entries × 256 bytes each = 32 768 bytes)
-    //    Just zero them all out
-    char zero_item[256] = {0};
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        if (fwrite(zero_item, sizeof(zero_item), 1, fp) != 1) {
-            perror("Failed to write file-list entry");
-            fclose(fp);
-            exit(EXIT_FAILURE);
-        }
+    else if (strcmp(cmd, "-sync") == 0 && argc == 3) {
+        SyncImage(disk);
     }
 
-    fclose(fp);
-    printf("Disk image \"%s\" formatted successfully.\n", disk_path);
-}
-
-
-/**
- * Write a host file into the disk image under a given name.
- */
-void Write(const char *disk_path, const char *srcPath, const char *destFileName) {
-    // Open source file
-    FILE *src = fopen(srcPath, "rb");
-    if (!src) { perror("Error opening source file"); exit(EXIT_FAILURE); }
-    // Determine file size
-    fseek(src, 0, SEEK_END);
-    long filesize = ftell(src);
-    fseek(src, 0, SEEK_SET);
-    int blocks = (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    else if (strcmp(cmd, "-sync") == 0 && argc == 5) {
+        SyncFile(disk, argv[3], argv[4]);
+    }
 
-    // Open disk image
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) { perror("Error opening disk image"); fclose(src); exit(EXIT_FAILURE); }
+    else if (strcmp(cmd, "-batch") == 0 && argc == 4) {
+        Batch(disk, argv[3]);
+    }
 
-    // Read FAT into memory
-    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
-    if (!fat) { perror("Allocating FAT"); fclose(src); fclose(disk); exit(EXIT_FAILURE); }
-    fseek(disk, 0, SEEK_SET);
-    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    else if (strcmp(cmd, "-df") == 0 && argc == 3) {
+        DiskFree(disk);
+    }
 
-    // Find empty blocks
-    int *chain = malloc(blocks * sizeof(int));
-    if (!chain) { perror("Allocating chain"); exit(EXIT_FAILURE); }
-    int found = 0;
-    for (int i = 1; i < FAT_ENTRIES && found < blocks; i++) {
-        if (fat[i] == 0) chain[found++] = i;
+    else if (strcmp(cmd, "-stat") == 0 && argc == 4) {
+        Stat(disk, argv[3]);
     }
-    if (found < blocks) {
-        fprintf(stderr, "Not enough free space\n");
-        free(fat); free(chain); fclose(src); fclose(disk);
-        exit(EXIT_FAILURE);
+
+    else if (strcmp(cmd, "-check") == 0 && argc == 3) {
+        Check(disk);
     }
-    // Update FAT entries
-    for (int j = 0; j < blocks - 1; j++) fat[chain[j]] = chain[j+1];
-    fat[chain[blocks - 1]] = 0xFFFFFFFF;
 
-    // Write updated FAT back
-    fseek(disk, 0, SEEK_SET);
-    fwrite(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
 
-    // Write file data blocks
-    char buffer[BLOCK_SIZE];
-    for (int j = 0; j < blocks; j++) {
-        size_t to_read = BLOCK_SIZE;
-        if (j == blocks - 1 && filesize % BLOCK_SIZE) to_read = filesize % BLOCK_SIZE;
-        fread(buffer, 1, to_read, src);
-        // zero-pad remainder
-        if (to_read < BLOCK_SIZE) memset(buffer + to_read, 0, BLOCK_SIZE - to_read);
-        // compute start of data region once (e.g. at top of Write())
-	size_t data_start = FAT_ENTRIES * sizeof(uint32_t) + FILE_ENTRIES * 256;
-
-	// then for each block:
-	off_t offset = (off_t)data_start + (off_t)chain[j] * BLOCK_SIZE;
-        fseek(disk, offset, SEEK_SET);
-        fwrite(buffer, 1, BLOCK_SIZE, disk);
-    }
-
-    // Update file list: find first free entry
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    int slot = -1;
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        long pos = filelist_offset + i * 256 + 248;
-        uint32_t firstBlock;
-        fseek(disk, pos, SEEK_SET);
-        fread(&firstBlock, sizeof(uint32_t), 1, disk);
-        if (firstBlock == 0) { slot = i; break; }
-    }
-    if (slot < 0) {
-        fprintf(stderr, "No free file-list entries\n");
-        free(fat); free(chain); fclose(src); fclose(disk);
-        exit(EXIT_FAILURE);
-    }
-    // Write file-list entry: name, first block, size
-    long entryPos = filelist_offset + slot * 256;
-    fseek(disk, entryPos, SEEK_SET);
-    char namebuf[248] = {0};
-    strncpy(namebuf, destFileName, 247);
-    fwrite(namebuf, 1, 248, disk);
-    uint32_t fb = chain[0];
-    fwrite(&fb, sizeof(fb), 1, disk);
-    uint32_t sz = (uint32_t)filesize;
-    fwrite(&sz, sizeof(sz), 1, disk);
-
-    printf("Copied '%s' -> '%s' (size: %ld bytes, %d blocks)\n", srcPath, destFileName, filesize, blocks);
+    else {
+        fprintf(stderr, "Unknown or malformed command\n");
+        return 1;
+    }
 
-    free(fat);
-    free(chain);
-    fclose(src);
-    fclose(disk);
+    return 0;
 }
 
+/* implement each function */
 
-/**
- * Read a file from the disk image back to the destination.
+/*
+ * Volumes: "vol:a.img,b.img,..." opens several images (or drives) as one.
+ * Member 0 holds the FAT and superblock; data blocks go round-robin to
+ * the members in stripe units of sb.stripeBlocks blocks, each member
+ * keeping the same layout (metadata area first, unused on the others).
+ * The volume is an ordinary FILE (fopencookie), so metadata code does
+ * not know about it; bulk file data goes through TransferBlocks, which
+ * runs one thread per member.
+ * With --direct every image, a single one too, is opened this way with
+ * O_DIRECT, and transfers the device cannot take as they are go through
+ * aligned pool buffers (see DirectPiece).
  */
-void Read(const char *disk_path, const char *srcFileName, const char *destPath) {
-    FILE *disk = fopen(disk_path, "rb");
-    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
-
-    // Load file list and find entry
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    uint32_t firstBlock = 0, filesize = 0;
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char namebuf[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-        if (strcmp(namebuf, srcFileName) == 0) {
-            fread(&firstBlock, sizeof(firstBlock), 1, disk);
-            fread(&filesize, sizeof(filesize), 1, disk);
-            break;
-        }
-    }
-    if (firstBlock == 0) { fprintf(stderr, "File not found: %s\n", srcFileName); fclose(disk); exit(EXIT_FAILURE); }
-
-    // Load FAT
-    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
-    fseek(disk, 0, SEEK_SET);
-    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+struct Volume {
+    FILE          *stream;
+    int            members;
+    int            fd[MAX_MEMBERS];
+    int            align[MAX_MEMBERS];  // O_DIRECT logical block size (0 = buffered)
+    uint32_t       stripe;      // blocks per member before moving to the next
+    off_t          pos;         // stream position
+    struct Volume *next;
+};
 
-    // Open destination file
-    FILE *dest = fopen(destPath, "wb");
-    if (!dest) { perror("Error creating destination file"); exit(EXIT_FAILURE); }
+static struct Volume *volumes;   /* open volume streams */
 
-    // Read chain of blocks
-    size_t data_start = FAT_ENTRIES * sizeof(uint32_t) + FILE_ENTRIES * 256;
-    uint32_t cur = firstBlock;
-    size_t remaining = filesize;
-    char buffer[BLOCK_SIZE];
-    while (1) {
-        off_t offset = data_start + cur * BLOCK_SIZE;
-        fseek(disk, offset, SEEK_SET);
-        size_t to_read = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
-        fread(buffer, 1, to_read, disk);
-        fwrite(buffer, 1, to_read, dest);
-        remaining -= to_read;
-        if (fat[cur] == 0xFFFFFFFF) break;
-        cur = fat[cur];
-    }
+/* One contiguous transfer on one member */
+struct IOPiece {
+    off_t  off;
+    char  *buf;
+    size_t len;
+};
 
-    printf("Read '%s' (%u bytes) -> '%s'\n", srcFileName, filesize, destPath);
+/* Everything one member has to transfer, done by one thread */
+struct MemberJob {
+    int             fd;
+    int             align;       // O_DIRECT logical block size (0 = buffered)
+    int             writing;
+    struct IOPiece *pieces;
+    int             count, cap;
+    int             error;       // errno of a failed transfer
+};
 
-    fclose(dest);
-    fclose(disk);
-    free(fat);
+/* The volume behind a stream; a plain image is a volume of one member */
+static struct Volume *VolumeOf(FILE *disk, struct Volume *plain) {
+    for (struct Volume *v = volumes; v; v = v->next)
+        if (v->stream == disk) return v;
+    memset(plain, 0, sizeof(*plain));
+    plain->stream  = disk;
+    plain->members = 1;
+    plain->fd[0]   = fileno(disk);
+    plain->stripe  = FAT_ENTRIES;
+    return plain;
 }
 
+/* The descriptor locks are taken on: member 0 holds the metadata */
+static int DiskFd(FILE *disk) {
+    struct Volume plain;
+    return VolumeOf(disk, &plain)->fd[0];
+}
 
-/* Delete: remove file and free its blocks */
-void Delete(const char *disk_path, const char *filename) {
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+static void AddPiece(struct MemberJob *job, off_t off, char *buf, size_t len) {
+    struct IOPiece *last = job->count ? &job->pieces[job->count - 1] : NULL;
+    if (last && last->off + (off_t)last->len == off && (!buf || last->buf + last->len == buf)) {
+        last->len += len;
+        return;
+    }
+    if (job->count == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 16;
+        job->pieces = realloc(job->pieces, job->cap * sizeof(struct IOPiece));
+        if (!job->pieces) { perror("Allocating I/O list"); exit(EXIT_FAILURE); }
+    }
+    job->pieces[job->count++] = (struct IOPiece){ off, buf, len };
+}
 
-    // Load file list and locate entry
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    uint32_t firstBlock = 0;
-    int slot = -1;
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char namebuf[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-        if (strcmp(namebuf, filename) == 0) {
-            fread(&firstBlock, sizeof(firstBlock), 1, disk);
-            slot = i;
-            break;
+/* Split a range of the image into the members' pieces */
+static void MapRange(const struct Volume *v, struct MemberJob *jobs, off_t pos, char *buf, size_t len) {
+    while (len > 0) {
+        int    m   = 0;
+        off_t  off = pos;
+        size_t n   = len;
+        if (pos < DATA_OFFSET) {
+            if ((off_t)n > DATA_OFFSET - pos) n = DATA_OFFSET - pos;
+        } else {
+            uint64_t blk  = (pos - DATA_OFFSET) / BLOCK_SIZE;
+            uint64_t unit = blk / v->stripe;
+            uint64_t left = (unit + 1) * v->stripe * BLOCK_SIZE - (pos - DATA_OFFSET);
+            m   = unit % v->members;
+            off = DATA_OFFSET + (off_t)((unit / v->members) * v->stripe + blk % v->stripe) * BLOCK_SIZE
+                + (pos - DATA_OFFSET) % BLOCK_SIZE;
+            if (n > left) n = left;
         }
+        jobs[m].fd    = v->fd[m];
+        jobs[m].align = v->align[m];
+        AddPiece(&jobs[m], off, buf, n);
+        pos += n;
+        len -= n;
+        if (buf) buf += n;
     }
-    if (slot < 0) {
-        fprintf(stderr, "File not found: %s\n", filename);
-        fclose(disk);
+}
+
+/*
+ * Aligned I/O buffers from posix_memalign, big enough for a whole file's
+ * data blocks. They are recycled rather than freed; the member threads
+ * share the pool.
+ */
+#define IO_ALIGN     4096
+#define IO_BUF_SIZE  ((size_t)FAT_ENTRIES * BLOCK_SIZE)
+
+static char *poolFree[MAX_MEMBERS];
+static int   poolCount;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *PoolGet(void) {
+    void *buf = NULL;
+    pthread_mutex_lock(&poolLock);
+    if (poolCount > 0) buf = poolFree[--poolCount];
+    pthread_mutex_unlock(&poolLock);
+    if (!buf && posix_memalign(&buf, IO_ALIGN, IO_BUF_SIZE) != 0) {
+        fprintf(stderr, "Allocating I/O buffer failed\n");
         exit(EXIT_FAILURE);
     }
+    return buf;
+}
 
-    // Load FAT
-    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
-    fseek(disk, 0, SEEK_SET);
-    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+static void PoolPut(char *buf) {
+    pthread_mutex_lock(&poolLock);
+    if (poolCount < MAX_MEMBERS) { poolFree[poolCount++] = buf; buf = NULL; }
+    pthread_mutex_unlock(&poolLock);
+    free(buf);
+}
 
-    // Traverse and clear the chain
-    uint32_t cur = firstBlock;
-    while (cur != 0xFFFFFFFF) {
-        uint32_t next = fat[cur];
-        fat[cur] = 0;
-	if (next == 0xFFFFFFFF)
-		break;
-        cur = next;
+/* Transfer all of len bytes; reads past the end of a member give zeros */
+static int FullIO(int fd, char *buf, size_t len, off_t off, int writing) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = writing ? pwrite(fd, buf + done, len - done, off + done)
+                            : pread(fd, buf + done, len - done, off + done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return errno;
+        if (r == 0) {   // past the end of a member that was never written
+            memset(buf + done, 0, len - done);
+            break;
+        }
+        done += r;
     }
-    
+    return 0;
+}
 
-    // Write updated FAT back
-    fseek(disk, 0, SEEK_SET);
-    fwrite(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+/*
+ * O_DIRECT transfer of a piece whose offset, length or buffer is not
+ * aligned to the member's logical block size: through a pool buffer
+ * covering the aligned range around it. Partial sectors are read before
+ * they are written back (read-modify-write). --direct is refused when a
+ * sector is larger than BLOCK_SIZE, so a sector never holds bytes of
+ * another block, which another process may own under its own lock.
+ */
+static int DirectPiece(struct MemberJob *job, const struct IOPiece *p) {
+    char *bounce = PoolGet();
+    off_t a = job->align;
+    int err = 0;
+    for (size_t done = 0; done < p->len && !err; ) {
+        off_t  off   = p->off + done;
+        off_t  start = off / a * a;
+        size_t len   = p->len - done;
+        if (len > IO_BUF_SIZE - 2 * a) len = IO_BUF_SIZE - 2 * a;
+        size_t span  = (off - start + len + a - 1) / a * a;
+        int partial  = off != start || span != off - start + len;
+
+        if (!job->writing || partial) err = FullIO(job->fd, bounce, span, start, 0);
+        if (!err && job->writing) {
+            memcpy(bounce + (off - start), p->buf + done, len);
+            err = FullIO(job->fd, bounce, span, start, 1);
+        } else if (!err) {
+            memcpy(p->buf + done, bounce + (off - start), len);
+        }
+        done += len;
+    }
+    PoolPut(bounce);
+    return err;
+}
 
-    // Clear the file-list entry
-    char zero_item[256] = {0};
-    fseek(disk, filelist_offset + slot*256, SEEK_SET);
-    fwrite(zero_item, sizeof(zero_item), 1, disk);
+static void *RunMemberJob(void *arg) {
+    struct MemberJob *job = arg;
+    for (int i = 0; i < job->count && !job->error; i++) {
+        struct IOPiece *p = &job->pieces[i];
+        int a = job->align;
+        if (a && (p->off % a || p->len % a || (uintptr_t)p->buf % a))
+            job->error = DirectPiece(job, p);
+        else
+            job->error = FullIO(job->fd, p->buf, p->len, p->off, job->writing);
+    }
+    return NULL;
+}
 
-    fclose(disk);
-    free(fat);
-    printf("Deleted file '%s' successfully.\n", filename);
+/* Run the members' jobs, in parallel when more than one has work */
+static int RunJobs(struct MemberJob *jobs, int members, int writing) {
+    pthread_t threads[MAX_MEMBERS];
+    int started[MAX_MEMBERS] = {0}, active = 0, err = 0;
+    for (int m = 0; m < members; m++) {
+        jobs[m].writing = writing;
+        if (jobs[m].count) active++;
+    }
+    for (int m = 0; m < members; m++) {
+        if (!jobs[m].count) continue;
+        if (active > 1 && pthread_create(&threads[m], NULL, RunMemberJob, &jobs[m]) == 0) started[m] = 1;
+        else RunMemberJob(&jobs[m]);
+    }
+    for (int m = 0; m < members; m++) {
+        if (started[m]) pthread_join(threads[m], NULL);
+        if (jobs[m].error && !err) err = jobs[m].error;
+        free(jobs[m].pieces);
+    }
+    if (err) { errno = err; return -1; }
+    return 0;
 }
 
-/* List: print all visible files and sizes */
-void List(const char *disk_path) {
-    FILE *disk = fopen(disk_path, "rb");
-    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
-    
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        // Read filename
-        char namebuf[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-        // Skip empty or hidden names
-        if (namebuf[0] == '\0' || namebuf[0] == '.') continue;
-        // Read size (at offset 248+4)
-        uint32_t filesize;
-        fseek(disk, filelist_offset + i*256 + 252, SEEK_SET);
-        fread(&filesize, sizeof(filesize), 1, disk);
-        printf("%s\t%u bytes\n", namebuf, filesize);
+/*
+ * Read or write data blocks to or from their buffers (one block each),
+ * all members at once. Neighbouring blocks in both the list and memory
+ * become one transfer.
+ */
+static void TransferBlocks(FILE *disk, const uint32_t *blocks, int n, char **bufs, int writing) {
+    struct Volume plain, *v = VolumeOf(disk, &plain);
+    struct MemberJob jobs[MAX_MEMBERS];
+    memset(jobs, 0, sizeof(jobs));
+    fflush(disk);   // nothing of ours may still sit in the stream buffer
+    for (int i = 0; i < n; i++)
+        MapRange(v, jobs, DATA_OFFSET + (off_t)blocks[i] * BLOCK_SIZE, bufs[i], BLOCK_SIZE);
+    if (RunJobs(jobs, v->members, writing) < 0) {
+        perror(writing ? "Error writing disk image" : "Error reading disk image");
+        exit(EXIT_FAILURE);
     }
-    fclose(disk);
 }
 
+static ssize_t VolumeRead(void *cookie, char *buf, size_t size) {
+    struct Volume *v = cookie;
+    off_t end = DATA_OFFSET + (off_t)FAT_ENTRIES * BLOCK_SIZE;
+    if (v->pos >= end) return 0;
+    if ((off_t)size > end - v->pos) size = end - v->pos;
+    struct MemberJob jobs[MAX_MEMBERS];
+    memset(jobs, 0, sizeof(jobs));
+    MapRange(v, jobs, v->pos, buf, size);
+    if (RunJobs(jobs, v->members, 0) < 0) return -1;
+    v->pos += size;
+    return size;
+}
 
+static ssize_t VolumeWrite(void *cookie, const char *buf, size_t size) {
+    struct Volume *v = cookie;
+    struct MemberJob jobs[MAX_MEMBERS];
+    memset(jobs, 0, sizeof(jobs));
+    MapRange(v, jobs, v->pos, (char *)buf, size);
+    if (RunJobs(jobs, v->members, 1) < 0) return -1;
+    v->pos += size;
+    return size;
+}
 
-/*   Sort      */
+static int VolumeSeek(void *cookie, off64_t *offset, int whence) {
+    struct Volume *v = cookie;
+    off_t pos = *offset;
+    if (whence == SEEK_CUR)      pos += v->pos;
+    else if (whence == SEEK_END) pos += DATA_OFFSET + (off_t)FAT_ENTRIES * BLOCK_SIZE;
+    if (pos < 0) { errno = EINVAL; return -1; }
+    *offset = v->pos = pos;
+    return 0;
+}
 
-/* short struct to hold name+size */
-struct FileInfo {
-    char     name[248];
-    uint32_t size;
-};
+static int VolumeClose(void *cookie) {
+    struct Volume *v = cookie;
+    for (struct Volume **p = &volumes; *p; p = &(*p)->next)
+        if (*p == v) { *p = v->next; break; }
+    int rc = 0;
+    for (int m = 0; m < v->members; m++)
+        if (close(v->fd[m]) < 0) rc = -1;
+    free(v);
+    return rc;
+}
 
-/* comparison for qsort: ascending by size */
-static int compare_size(const void *a, const void *b) {
-    const struct FileInfo *fa = a;
-    const struct FileInfo *fb = b;
-    if (fa->size < fb->size) return -1;
-    if (fa->size > fb->size) return  1;
-    return 0;
+/*
+ * Alignment O_DIRECT needs: the device's logical block size. For an image
+ * file, one block-sized direct read tells whether the file system takes
+ * BLOCK_SIZE; if not, fall back to its preferred I/O size.
+ */
+static int LogicalBlockSize(int fd) {
+    struct stat st;
+    int size = BLOCK_SIZE;
+    if (fstat(fd, &st) < 0) return size;
+    if (S_ISBLK(st.st_mode)) {
+        ioctl(fd, BLKSSZGET, &size);
+    } else {
+        char *probe = PoolGet();
+        if (pread(fd, probe, BLOCK_SIZE, BLOCK_SIZE) < 0 && st.st_blksize > BLOCK_SIZE) size = st.st_blksize;
+        PoolPut(probe);
+    }
+    return size;
 }
 
-void Sort(const char *disk_path) {
-    FILE *disk = fopen(disk_path, "rb");
-    if (!disk) {
-        perror("Error opening disk image");
-        exit(EXIT_FAILURE);
+/*
+ * Does the way a disk is opened match how it was formatted? A volume
+ * member opened on its own, or a plain image inside a vol: list, would
+ * map block numbers to the wrong image.
+ */
+static int CheckGeometry(const char *disk_path, const struct Superblock *sb, int isVolume, int members) {
+    if (sb->magic != SB_MAGIC) return 0;   // not formatted yet
+    if (!isVolume && sb->members > 0) {
+        fprintf(stderr, "%s is member 1 of a %u-image volume: open it as vol:<members>\n",
+                disk_path, sb->members);
+        return -1;
+    }
+    if (isVolume && sb->members == 0) {
+        fprintf(stderr, "%s: the first member is a plain image, not a volume\n", disk_path);
+        return -1;
     }
+    if (isVolume && (int)sb->members != members) {
+        fprintf(stderr, "Volume was formatted with %u members, %d given\n", sb->members, members);
+        return -1;
+    }
+    return 0;
+}
 
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    struct FileInfo files[FILE_ENTRIES];
-    int count = 0;
+/*
+ * fopen() for disk paths: a plain image or drive, or a "vol:" list of
+ * members. A volume takes its stripe size from the superblock, or from
+ * --stripe when fresh (Format) or not formatted yet. Returns NULL with
+ * errno set on failure, like fopen().
+ */
+static FILE *OpenVolume(const char *disk_path, const char *mode, int fresh) {
+    int isVolume = strncmp(disk_path, "vol:", 4) == 0;
+    if (!isVolume && !directMode) {
+        FILE *fp = fopen(disk_path, mode);
+        struct Superblock sb;
+        if (fp && !fresh && fseek(fp, DATA_OFFSET, SEEK_SET) == 0 && fread(&sb, sizeof(sb), 1, fp) == 1
+            && CheckGeometry(disk_path, &sb, 0, 1) < 0) {
+            fclose(fp);
+            errno = EINVAL;
+            return NULL;
+        }
+        return fp;
+    }
 
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char namebuf[248] = {0};
-        uint32_t filesize;
+    struct Volume *v = calloc(1, sizeof(*v));
+    char list[PATH_LEN * MAX_MEMBERS];
+    if (!v) return NULL;
+    snprintf(list, sizeof(list), "%s", isVolume ? disk_path + 4 : disk_path);
+    int flags = (strchr(mode, '+') ? O_RDWR : O_RDONLY) | (directMode ? O_DIRECT : 0);
+    char *save, *name = isVolume ? strtok_r(list, ",", &save) : list;
+    for (; name; name = isVolume ? strtok_r(NULL, ",", &save) : NULL) {
+        int fd = v->members < MAX_MEMBERS ? open(name, flags) : (errno = E2BIG, -1);
+        if (fd < 0) {
+            int err = errno;
+            while (v->members > 0) close(v->fd[--v->members]);
+            free(v);
+            errno = err;
+            return NULL;
+        }
+        if (directMode) v->align[v->members] = LogicalBlockSize(fd);
+        v->fd[v->members++] = fd;
+    }
 
-        /* read filename */
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
+    // The superblock is on member 0 whatever the stripe
+    struct Superblock sb;
+    struct MemberJob probe = { .fd = v->fd[0], .align = v->align[0] };
+    int bad = 0;
+    v->stripe = isVolume ? stripeSize / BLOCK_SIZE : FAT_ENTRIES;
+    AddPiece(&probe, DATA_OFFSET, (char *)&sb, sizeof(sb));
+    if (RunJobs(&probe, 1, 0) == 0 && !fresh) {
+        bad = CheckGeometry(disk_path, &sb, isVolume, v->members) < 0;
+        if (!bad && sb.magic == SB_MAGIC && isVolume) v->stripe = sb.stripeBlocks;
+    }
+    if (!bad && (v->members == 0 || v->stripe == 0)) {
+        fprintf(stderr, "Bad volume: %s\n", disk_path);
+        bad = 1;
+    }
+    for (int m = 0; m < v->members && !bad; m++) {
+        if (v->align[m] > BLOCK_SIZE) {
+            fprintf(stderr, "--direct needs %d-byte sectors, member %d has %d\n",
+                    BLOCK_SIZE, m + 1, v->align[m]);
+            bad = 1;
+        }
+    }
+    if (bad) {
+        VolumeClose(v);
+        errno = EINVAL;
+        return NULL;
+    }
 
-        /* skip empty or hidden */
-        if (namebuf[0] == '\0' || namebuf[0] == '.')
-            continue;
+    cookie_io_functions_t io = { VolumeRead, VolumeWrite, VolumeSeek, VolumeClose };
+    v->stream = fopencookie(v, mode, io);
+    if (!v->stream) { VolumeClose(v); return NULL; }
+    v->next = volumes;
+    volumes = v;
+    return v->stream;
+}
 
-        /* read size at offset 252 (248 name + 4 firstBlock) */
-        fseek(disk, filelist_offset + i*256 + 252, SEEK_SET);
-        fread(&filesize, sizeof(filesize), 1, disk);
+static FILE *OpenDisk(const char *disk_path, const char *mode) {
+    return OpenVolume(disk_path, mode, 0);
+}
 
-        /* store */
-        strncpy(files[count].name, namebuf, 247);
-        files[count].size = filesize;
-        count++;
+/**
+ * Take (or release) an fcntl byte-range lock on the image, waiting if needed.
+ *
+ * Several myfs processes may work on the same image at once:
+ *  - read-only commands hold a shared lock on the metadata (FAT and
+ *    superblock) for as long as they run; directory nodes live in data
+ *    blocks but are only read or changed under this lock as well,
+ *  - mutating commands lock the metadata exclusively only while they allocate
+ *    blocks or commit a directory entry, and move file data while holding a
+ *    shared lock on the data region,
+ *  - Format, Defragment and the snapshot commands lock the whole image
+ *    exclusively.
+ * A len of 0 means "up to the end of the image".
+ */
+static void LockRegion(FILE *disk, short type, off_t start, off_t len) {
+    // Push our pending writes out (and drop stale read buffers) before the
+    // region changes hands
+    fflush(disk);
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = start;
+    fl.l_len    = len;
+    while (fcntl(DiskFd(disk), F_SETLKW, &fl) == -1) {
+        if (errno == EINTR) continue;
+        perror("Error locking disk image");
+        exit(EXIT_FAILURE);
     }
-    fclose(disk);
-
-    /* sort by size */
-    qsort(files, count, sizeof(files[0]), compare_size);
+}
 
-    /* print sorted */
-    for (int i = 0; i < count; i++) {
-        printf("%s\t%u bytes\n", files[i].name, files[i].size);
+/* Read the superblock; images formatted before it existed get an empty one */
+static void LoadSuperblock(FILE *disk, struct Superblock *sb) {
+    fseek(disk, DATA_OFFSET, SEEK_SET);
+    if (fread(sb, sizeof(*sb), 1, disk) != 1 || sb->magic != SB_MAGIC) {
+        memset(sb, 0, sizeof(*sb));
+        sb->magic = SB_MAGIC;
     }
 }
 
-void RenameFile(const char *disk_path, const char *srcFileName, const char *newFileName) {
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) {
-        perror("Error opening disk image");
+static void StoreSuperblock(FILE *disk, const struct Superblock *sb) {
+    fseek(disk, DATA_OFFSET, SEEK_SET);
+    if (fwrite(sb, sizeof(*sb), 1, disk) != 1) {
+        perror("Failed to write superblock");
         exit(EXIT_FAILURE);
     }
+}
 
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    int slot = -1;
-
-    // First, ensure no other file is already using newFileName
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char existing[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(existing, 1, 248, disk);
-        if (strcmp(existing, newFileName) == 0) {
-            fprintf(stderr, "A file named '%s' already exists\n", newFileName);
-            fclose(disk);
-            exit(EXIT_FAILURE);
+/* Free / used blocks and the longest free run of a FAT (block 0 excluded) */
+static void CountBlocks(const uint32_t *fat, struct Superblock *sb) {
+    uint32_t run = 0;
+    sb->freeBlocks = sb->usedBlocks = sb->largestFree = 0;
+    for (int i = 1; i < FAT_ENTRIES; i++) {
+        if (fat[i] == 0) {
+            sb->freeBlocks++;
+            if (++run > sb->largestFree) sb->largestFree = run;
+        } else {
+            if (fat[i] != FAT_SNAPSHOT) sb->usedBlocks++;
+            run = 0;
         }
     }
+}
 
-    // Locate the entry for srcFileName
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char namebuf[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-        if (strcmp(namebuf, srcFileName) == 0) {
-            slot = i;
-            break;
-        }
-    }
-    if (slot < 0) {
-        fprintf(stderr, "File not found: %s\n", srcFileName);
-        fclose(disk);
+/*
+ * Write a changed FAT back together with the superblock. The block
+ * counters are brought up to date from the FAT in memory on the way, so
+ * they change in the same locked commit as the blocks they describe.
+ * They are recounted rather than adjusted by each operation's delta: the
+ * largest free run needs a pass over the FAT anyway, and that pass is
+ * cheap next to writing the same 4096 entries out.
+ */
+static void StoreFAT(FILE *disk, const uint32_t *fat, struct Superblock *sb) {
+    CountBlocks(fat, sb);
+    fseek(disk, 0, SEEK_SET);
+    if (fwrite(fat, sizeof(uint32_t), FAT_ENTRIES, disk) != FAT_ENTRIES) {
+        perror("Failed to write FAT");
         exit(EXIT_FAILURE);
     }
+    StoreSuperblock(disk, sb);
+}
 
-    // Write the new name (zero-padded to 248 bytes)
-    char newbuf[248] = {0};
-    strncpy(newbuf, newFileName, sizeof(newbuf)-1);
-    fseek(disk, filelist_offset + slot*256, SEEK_SET);
-    fwrite(newbuf, 1, sizeof(newbuf), disk);
+/*   Directories   */
+
+/*
+ * Every directory is a B+tree of DirEntry records ordered by name, one node
+ * per block; the root directory hangs off the superblock. Nodes are only
+ * read under a metadata lock and only changed under an exclusive one.
+ *
+ * Node: u8 type, u8 unused, u16 count, u32 link, then count records
+ *   leaf:      u8 nameLen, u8 flags, u32 firstBlock, u32 size, name,
+ *              then u32 tailBlock, u16 tailOff (DIRENT_TAIL)
+ *              or the data itself (DIRENT_INLINE)
+ *   internal:  u8 keyLen, u32 child, key
+ * In an internal node, link is the child for names below the first key and
+ * each record's child holds names from its key up to the next one. Nodes
+ * that empty out are freed; underfull nodes are not merged.
+ */
+#define NODE_LEAF      1
+#define NODE_INTERNAL  2
+#define NODE_HEADER    8
+#define MAX_NODE_RECS  96     /* a node holds at most ~84 one-character keys */
+
+struct DirNode {
+    uint8_t         type;
+    int             count;
+    uint32_t        link;
+    struct DirEntry rec[MAX_NODE_RECS + 1];   // internal: name = key, firstBlock = child
+};
 
-    printf("Renamed '%s' -> '%s'\n", srcFileName, newFileName);
-    fclose(disk);
+/* Bytes the packed part of a leaf record takes after its name */
+static size_t ExtraBytes(const struct DirEntry *e) {
+    if (e->flags & DIRENT_INLINE) return e->size;
+    if (e->flags & DIRENT_TAIL)   return 6;
+    return 0;
 }
 
-void Duplicate(const char *disk_path, const char *srcFileName) {
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+static size_t RecordBytes(const struct DirNode *node, const struct DirEntry *e) {
+    if (node->type == NODE_LEAF) return 10 + strlen(e->name) + ExtraBytes(e);
+    return 5 + strlen(e->name);
+}
 
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    uint32_t firstBlock = 0, filesize = 0;
-    int slotSrc = -1;
+static size_t NodeBytes(const struct DirNode *node) {
+    size_t bytes = NODE_HEADER;
+    for (int i = 0; i < node->count; i++) bytes += RecordBytes(node, &node->rec[i]);
+    return bytes;
+}
 
-    // 1) Find source entry
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char namebuf[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-        if (strcmp(namebuf, srcFileName) == 0) {
-            // read firstBlock and filesize
-            fread(&firstBlock, sizeof(firstBlock), 1, disk);
-            fread(&filesize, sizeof(filesize), 1, disk);
-            slotSrc = i;
-            break;
-        }
+static void LoadNode(FILE *disk, uint32_t blk, struct DirNode *node) {
+    unsigned char buf[BLOCK_SIZE];
+    fseek(disk, DATA_OFFSET + (off_t)blk * BLOCK_SIZE, SEEK_SET);
+    if (fread(buf, 1, BLOCK_SIZE, disk) != BLOCK_SIZE) {
+        fprintf(stderr, "Error reading directory block %u\n", blk);
+        exit(EXIT_FAILURE);
     }
-    if (slotSrc < 0) {
-        fprintf(stderr, "File not found: %s\n", srcFileName);
-        fclose(disk);
+    node->type  = buf[0];
+    node->count = buf[2] | buf[3] << 8;
+    memcpy(&node->link, buf + 4, sizeof(uint32_t));
+    if ((node->type != NODE_LEAF && node->type != NODE_INTERNAL) || node->count > MAX_NODE_RECS) {
+        fprintf(stderr, "Corrupt directory block %u\n", blk);
         exit(EXIT_FAILURE);
     }
 
-    // 2) Build new name = srcFileName + "_copy"
-    char newName[248] = {0};
-    const char *suffix = "_copy";
-    size_t maxBase = sizeof(newName) - 1 - strlen(suffix);
-    size_t baseLen = strlen(srcFileName) < maxBase ? strlen(srcFileName) : maxBase;
-    memcpy(newName, srcFileName, baseLen);
-    memcpy(newName + baseLen, suffix, strlen(suffix));
-    newName[baseLen + strlen(suffix)] = '\0';
-
+    const unsigned char *p = buf + NODE_HEADER;
+    for (int i = 0; i < node->count; i++) {
+        struct DirEntry *e = &node->rec[i];
+        size_t len = *p++;
+        size_t fixed = node->type == NODE_LEAF ? 9 : 4;
+        if (len >= NAME_LEN || p + fixed + len > buf + BLOCK_SIZE) {
+            fprintf(stderr, "Corrupt directory block %u\n", blk);
+            exit(EXIT_FAILURE);
+        }
+        e->flags = 0;
+        e->size  = 0;
+        if (node->type == NODE_LEAF) e->flags = *p++;
+        memcpy(&e->firstBlock, p, sizeof(uint32_t)); p += 4;
+        if (node->type == NODE_LEAF) { memcpy(&e->size, p, sizeof(uint32_t)); p += 4; }
+        memcpy(e->name, p, len);
+        e->name[len] = '\0';
+        p += len;
+
+        size_t extra = node->type == NODE_LEAF ? ExtraBytes(e) : 0;
+        if (((e->flags & DIRENT_INLINE) && e->size > INLINE_MAX) || p + extra > buf + BLOCK_SIZE) {
+            fprintf(stderr, "Corrupt directory block %u\n", blk);
+            exit(EXIT_FAILURE);
+        }
+        if (e->flags & DIRENT_TAIL) {
+            memcpy(&e->tailBlock, p, sizeof(uint32_t));
+            memcpy(&e->tailOff, p + 4, sizeof(uint16_t));
+        } else if (e->flags & DIRENT_INLINE) {
+            memcpy(e->data, p, extra);
+        }
+        p += extra;
+    }
+}
+
+static void StoreNode(FILE *disk, uint32_t blk, const struct DirNode *node) {
+    unsigned char buf[BLOCK_SIZE] = {0};
+    buf[0] = node->type;
+    buf[2] = node->count & 0xFF;
+    buf[3] = node->count >> 8;
+    memcpy(buf + 4, &node->link, sizeof(uint32_t));
+
+    unsigned char *p = buf + NODE_HEADER;
+    for (int i = 0; i < node->count; i++) {
+        const struct DirEntry *e = &node->rec[i];
+        size_t len = strlen(e->name);
+        *p++ = (unsigned char)len;
+        if (node->type == NODE_LEAF) *p++ = e->flags;
+        memcpy(p, &e->firstBlock, sizeof(uint32_t)); p += 4;
+        if (node->type == NODE_LEAF) { memcpy(p, &e->size, sizeof(uint32_t)); p += 4; }
+        memcpy(p, e->name, len);
+        p += len;
+        if (node->type != NODE_LEAF) continue;
+        if (e->flags & DIRENT_TAIL) {
+            memcpy(p, &e->tailBlock, sizeof(uint32_t));
+            memcpy(p + 4, &e->tailOff, sizeof(uint16_t));
+        } else if (e->flags & DIRENT_INLINE) {
+            memcpy(p, e->data, e->size);
+        }
+        p += ExtraBytes(e);
+    }
+    fseek(disk, DATA_OFFSET + (off_t)blk * BLOCK_SIZE, SEEK_SET);
+    if (fwrite(buf, 1, BLOCK_SIZE, disk) != BLOCK_SIZE) {
+        perror("Failed to write directory block");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static struct DirNode *NewNode(void) {
+    struct DirNode *node = malloc(sizeof(struct DirNode));
+    if (!node) { perror("Allocating directory node"); exit(EXIT_FAILURE); }
+    return node;
+}
+
+/* Take the first free block for a directory node, or 0 if there is none */
+static uint32_t AllocNode(uint32_t *fat) {
+    for (uint32_t b = 1; b < FAT_ENTRIES; b++) {
+        if (fat[b] == 0) { fat[b] = FAT_EOC; return b; }
+    }
+    return 0;
+}
+
+/* Index of the last record <= name, or -1 */
+static int NodeSearch(const struct DirNode *node, const char *name) {
+    int lo = 0, hi = node->count;   // first record > name is in [lo, hi]
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(node->rec[mid].name, name) <= 0) lo = mid + 1;
+        else                                         hi = mid;
+    }
+    return lo - 1;
+}
+
+/* Look a name up in one directory; returns 1 and fills *out if found */
+static int DirFind(FILE *disk, uint32_t root, const char *name, struct DirEntry *out) {
+    if (root == 0) return 0;
+    struct DirNode *node = NewNode();
+    uint32_t blk = root;
+    int found = 0;
+    while (1) {
+        LoadNode(disk, blk, node);
+        int i = NodeSearch(node, name);
+        if (node->type == NODE_INTERNAL) {
+            blk = i < 0 ? node->link : node->rec[i].firstBlock;
+            continue;
+        }
+        if (i >= 0 && strcmp(node->rec[i].name, name) == 0) {
+            if (out) *out = node->rec[i];
+            found = 1;
+        }
+        break;
+    }
+    free(node);
+    return found;
+}
+
+/*
+ * Can every node an insert into the tree at root may need be allocated?
+ * A split can climb all the way up and add a root: one node per level,
+ * plus one. Checked before the first node is written, so that an insert
+ * either happens completely or leaves the tree alone.
+ */
+static int TreeRoom(FILE *disk, const uint32_t *fat, uint32_t root) {
+    int need = 1;
+    if (root != 0) {
+        struct DirNode *node = NewNode();
+        for (uint32_t blk = root; ; blk = node->link) {
+            LoadNode(disk, blk, node);
+            need++;
+            if (node->type != NODE_INTERNAL) break;
+        }
+        free(node);
+    }
+    for (int b = 1; b < FAT_ENTRIES && need > 0; b++) {
+        if (fat[b] == 0) need--;
+    }
+    return need == 0;
+}
+
+/*
+ * Move the upper part of an overfull node into a new right sibling, as
+ * evenly by bytes as possible. *sep gets the separator for the parent:
+ * the lowest name on the right and the new block. Returns -1, with
+ * nothing written, if no block is free for the sibling.
+ */
+static int SplitNode(FILE *disk, uint32_t *fat, uint32_t blk, struct DirNode *node, struct DirEntry *sep) {
+    size_t prefix[MAX_NODE_RECS + 2];
+    prefix[0] = 0;
+    for (int i = 0; i < node->count; i++) prefix[i+1] = prefix[i] + RecordBytes(node, &node->rec[i]);
+    size_t total = prefix[node->count];
+
+    // Leaves split between records; internal nodes push record m up
+    int leaf = node->type == NODE_LEAF;
+    int best = 1;
+    size_t bestCost = (size_t)-1;
+    for (int m = 1; m < node->count - !leaf; m++) {
+        size_t left  = prefix[m];
+        size_t right = total - prefix[m + !leaf];
+        size_t cost  = left > right ? left : right;
+        if (cost < bestCost) { bestCost = cost; best = m; }
+    }
+
+    uint32_t sibling = AllocNode(fat);
+    if (sibling == 0) return -1;
+    struct DirNode *right = NewNode();
+    right->type = node->type;
+    right->link = 0;
+    int from = best;
+    if (!leaf) {
+        right->link = node->rec[best].firstBlock;
+        from = best + 1;
+    }
+    right->count = node->count - from;
+    memcpy(right->rec, node->rec + from, right->count * sizeof(struct DirEntry));
+
+    memset(sep, 0, sizeof(*sep));
+    strcpy(sep->name, node->rec[best].name);
+    sep->firstBlock = sibling;
+    node->count = best;
+
+    StoreNode(disk, blk, node);
+    StoreNode(disk, sep->firstBlock, right);
+    free(right);
+    return 0;
+}
+
+/*
+ * Insert below blk: 0 done, 1 split (*sep goes into the parent), -1
+ * exists, -2 no block for a new node
+ */
+static int NodeInsert(FILE *disk, uint32_t *fat, uint32_t blk, const struct DirEntry *e, struct DirEntry *sep) {
+    struct DirNode *node = NewNode();
+    LoadNode(disk, blk, node);
+    int i = NodeSearch(node, e->name);
+    struct DirEntry rec = *e;
+
+    if (node->type == NODE_LEAF) {
+        if (i >= 0 && strcmp(node->rec[i].name, e->name) == 0) { free(node); return -1; }
+    } else {
+        uint32_t child = i < 0 ? node->link : node->rec[i].firstBlock;
+        int r = NodeInsert(disk, fat, child, e, &rec);
+        if (r <= 0) { free(node); return r; }
+        // the child split: add the separator behind it
+    }
+
+    memmove(&node->rec[i + 2], &node->rec[i + 1], (node->count - i - 1) * sizeof(struct DirEntry));
+    node->rec[i + 1] = rec;
+    node->count++;
+
+    int split = 0;
+    if (NodeBytes(node) > BLOCK_SIZE || node->count > MAX_NODE_RECS) {
+        split = SplitNode(disk, fat, blk, node, sep) < 0 ? -2 : 1;
+    } else {
+        StoreNode(disk, blk, node);
+    }
+    free(node);
+    return split;
+}
+
+/*
+ * Add an entry to the directory whose tree starts at *root, allocating
+ * nodes from fat. Returns 0, -1 if the name exists, or -2 (tree
+ * unchanged) if fat has too few free blocks for the nodes it may need.
+ * *root changes when the tree grows a level.
+ */
+static int DirInsert(FILE *disk, uint32_t *fat, uint32_t *root, const struct DirEntry *e) {
+    if (!TreeRoom(disk, fat, *root)) return DirFind(disk, *root, e->name, NULL) ? -1 : -2;
+
+    struct DirNode *node = NewNode();
+    int r = 0;
+    if (*root == 0) {
+        node->type = NODE_LEAF;
+        node->link = 0;
+        node->count = 1;
+        node->rec[0] = *e;
+        *root = AllocNode(fat);
+        StoreNode(disk, *root, node);
+    } else {
+        struct DirEntry sep;
+        r = NodeInsert(disk, fat, *root, e, &sep);
+        if (r == 1) {
+            // Root split: new root with the old one and its sibling
+            node->type = NODE_INTERNAL;
+            node->link = *root;
+            node->count = 1;
+            node->rec[0] = sep;
+            *root = AllocNode(fat);
+            StoreNode(disk, *root, node);
+            r = 0;
+        }
+    }
+    free(node);
+    return r;
+}
+
+/* Remove below blk: -1 not found, 0 removed, 1 removed and blk freed (now empty) */
+static int NodeRemove(FILE *disk, uint32_t *fat, uint32_t blk, const char *name, struct DirEntry *removed) {
+    struct DirNode *node = NewNode();
+    LoadNode(disk, blk, node);
+    int i = NodeSearch(node, name);
+
+    if (node->type == NODE_LEAF) {
+        if (i < 0 || strcmp(node->rec[i].name, name) != 0) { free(node); return -1; }
+        if (removed) *removed = node->rec[i];
+    } else {
+        uint32_t child = i < 0 ? node->link : node->rec[i].firstBlock;
+        int r = NodeRemove(disk, fat, child, name, removed);
+        if (r <= 0) { free(node); return r; }
+        // the child emptied out: drop the pointer to it
+        if (i < 0) {
+            if (node->count == 0) { fat[blk] = 0; free(node); return 1; }
+            node->link = node->rec[0].firstBlock;
+            i = 0;
+        }
+    }
+
+    memmove(&node->rec[i], &node->rec[i + 1], (node->count - i - 1) * sizeof(struct DirEntry));
+    node->count--;
+    if (node->type == NODE_LEAF && node->count == 0) { fat[blk] = 0; free(node); return 1; }
+    StoreNode(disk, blk, node);
+    free(node);
+    return 0;
+}
+
+/* Remove a name from a directory; 0 or -1 if missing. *root may change. */
+static int DirRemove(FILE *disk, uint32_t *fat, uint32_t *root, const char *name, struct DirEntry *removed) {
+    if (*root == 0) return -1;
+    int r = NodeRemove(disk, fat, *root, name, removed);
+    if (r < 0) return -1;
+    if (r == 1) { *root = 0; return 0; }
+
+    // An internal root left with a single child hands over to it
+    struct DirNode *node = NewNode();
+    while (1) {
+        LoadNode(disk, *root, node);
+        if (node->type != NODE_INTERNAL || node->count > 0) break;
+        fat[*root] = 0;
+        *root = node->link;
+    }
+    free(node);
+    return 0;
+}
+
+/*
+ * Replace an entry's record (same name) in place; 0, -1 if missing, or -2
+ * if the new record no longer fits in its node.
+ */
+static int DirUpdate(FILE *disk, uint32_t root, const struct DirEntry *e) {
+    if (root == 0) return -1;
+    struct DirNode *node = NewNode();
+    uint32_t blk = root;
+    int r = -1;
+    while (1) {
+        LoadNode(disk, blk, node);
+        int i = NodeSearch(node, e->name);
+        if (node->type == NODE_INTERNAL) {
+            blk = i < 0 ? node->link : node->rec[i].firstBlock;
+            continue;
+        }
+        if (i >= 0 && strcmp(node->rec[i].name, e->name) == 0) {
+            node->rec[i] = *e;
+            r = -2;
+            if (NodeBytes(node) <= BLOCK_SIZE) {
+                StoreNode(disk, blk, node);
+                r = 0;
+            }
+        }
+        break;
+    }
+    free(node);
+    return r;
+}
+
+static void CollectNode(FILE *disk, uint32_t blk, struct DirEntry **list, int *count, int *cap, int *nodes) {
+    struct DirNode *node = NewNode();
+    LoadNode(disk, blk, node);
+    if (nodes) (*nodes)++;
+    if (node->type == NODE_INTERNAL) {
+        CollectNode(disk, node->link, list, count, cap, nodes);
+        for (int i = 0; i < node->count; i++)
+            CollectNode(disk, node->rec[i].firstBlock, list, count, cap, nodes);
+    } else {
+        if (*count + node->count > *cap) {
+            *cap = (*count + node->count) * 2;
+            *list = realloc(*list, *cap * sizeof(struct DirEntry));
+            if (!*list) { perror("Allocating directory"); exit(EXIT_FAILURE); }
+        }
+        memcpy(*list + *count, node->rec, node->count * sizeof(struct DirEntry));
+        *count += node->count;
+    }
+    free(node);
+}
+
+/*
+ * All entries of one directory, in name order. If nodes is not NULL, the
+ * number of tree nodes read is added to it.
+ */
+static struct DirEntry *LoadDir(FILE *disk, uint32_t root, int *count, int *nodes) {
+    struct DirEntry *list = malloc(sizeof(struct DirEntry));
+    if (!list) { perror("Allocating directory"); exit(EXIT_FAILURE); }
+    int cap = 1;
+    *count = 0;
+    if (root != 0) CollectNode(disk, root, &list, count, &cap, nodes);
+    return list;
+}
+
+static void CollectTree(FILE *disk, uint32_t root, const char *prefix, int depth,
+                        struct PathEntry **list, int *count, int *cap, int *nodes) {
+    int n;
+    struct DirEntry *entries = LoadDir(disk, root, &n, nodes);
+    for (int i = 0; i < n; i++) {
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            *list = realloc(*list, *cap * sizeof(struct PathEntry));
+            if (!*list) { perror("Allocating path list"); exit(EXIT_FAILURE); }
+        }
+        struct PathEntry *pe = &(*list)[(*count)++];
+        pe->path = malloc(strlen(prefix) + strlen(entries[i].name) + 2);
+        if (!pe->path) { perror("Allocating path list"); exit(EXIT_FAILURE); }
+        sprintf(pe->path, "%s%s", prefix, entries[i].name);
+        pe->depth = depth;
+        pe->e = entries[i];
+        if (entries[i].flags & DIRENT_DIR) {
+            char *sub = malloc(strlen(pe->path) + 2);
+            if (!sub) { perror("Allocating path list"); exit(EXIT_FAILURE); }
+            sprintf(sub, "%s/", pe->path);
+            CollectTree(disk, entries[i].firstBlock, sub, depth + 1, list, count, cap, nodes);
+            free(sub);
+        }
+    }
+    free(entries);
+}
+
+/* Every entry below a directory with its full path, parents before children */
+static struct PathEntry *LoadTree(FILE *disk, uint32_t root, int *count, int *nodes) {
+    struct PathEntry *list = NULL;
+    int cap = 0;
+    *count = 0;
+    CollectTree(disk, root, "", 0, &list, count, &cap, nodes);
+    return list;
+}
+
+static void FreeTree(struct PathEntry *list, int count) {
+    for (int i = 0; i < count; i++) free(list[i].path);
+    free(list);
+}
+
+/*
+ * Build a packed tree from entries already in name order (Defragment):
+ * leaves are filled one after the other, then each level above them.
+ * Returns the root, 0 for an empty directory, or FAT_EOC if fat ran out
+ * of blocks for the nodes.
+ */
+static uint32_t BuildDir(FILE *disk, uint32_t *fat, const struct DirEntry *entries, int n) {
+    if (n == 0) return 0;
+    struct DirNode *node = NewNode();
+    struct DirEntry *level = malloc(n * sizeof(struct DirEntry));   // lowest name + block of each node
+    if (!level) { perror("Allocating directory"); exit(EXIT_FAILURE); }
+
+    int count = 0;
+    node->type = NODE_LEAF;
+    node->link = 0;
+    for (int i = 0; i < n; ) {
+        node->count = 0;
+        size_t bytes = NODE_HEADER;
+        while (i < n && node->count < MAX_NODE_RECS && bytes + RecordBytes(node, &entries[i]) <= BLOCK_SIZE) {
+            bytes += RecordBytes(node, &entries[i]);
+            node->rec[node->count++] = entries[i++];
+        }
+        level[count] = node->rec[0];
+        level[count].firstBlock = AllocNode(fat);
+        if (level[count].firstBlock == 0) { free(level); free(node); return FAT_EOC; }
+        StoreNode(disk, level[count].firstBlock, node);
+        count++;
+    }
+
+    node->type = NODE_INTERNAL;
+    while (count > 1) {
+        int up = 0;
+        for (int i = 0; i < count; ) {
+            node->link  = level[i].firstBlock;
+            node->count = 0;
+            struct DirEntry lowest = level[i++];
+            size_t bytes = NODE_HEADER;
+            while (i < count && node->count < MAX_NODE_RECS && bytes + RecordBytes(node, &level[i]) <= BLOCK_SIZE) {
+                bytes += RecordBytes(node, &level[i]);
+                node->rec[node->count++] = level[i++];
+            }
+            lowest.firstBlock = AllocNode(fat);
+            if (lowest.firstBlock == 0) { free(level); free(node); return FAT_EOC; }
+            StoreNode(disk, lowest.firstBlock, node);
+            level[up++] = lowest;
+        }
+        count = up;
+    }
+
+    uint32_t root = level[0].firstBlock;
+    free(level);
+    free(node);
+    return root;
+}
+
+
+/*   Paths   */
+
+/*
+ * Split "a/b/c" into its directory ("a/b") and last component ("c").
+ * Returns -1 if the last component is empty or too long.
+ */
+static int SplitPath(const char *path, char *dirPath, char *name) {
+    char buf[PATH_LEN];
+    strncpy(buf, path, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    size_t len = strlen(buf);
+    while (len > 0 && buf[len-1] == '/') buf[--len] = '\0';
+
+    char *slash = strrchr(buf, '/');
+    const char *last = slash ? slash + 1 : buf;
+    if (last[0] == '\0' || strlen(last) >= NAME_LEN) return -1;
+    strcpy(name, last);
+    if (slash) { *slash = '\0'; strcpy(dirPath, buf); }
+    else       dirPath[0] = '\0';
+    return 0;
+}
+
+/* Resolve a directory path ("" or "/" is the root); -1 if missing or not a directory */
+static int OpenDir(FILE *disk, const struct Superblock *sb, const char *path, struct DirRef *dir) {
+    memset(dir, 0, sizeof(*dir));
+    dir->root   = sb->rootDir;
+    dir->isRoot = 1;
+
+    char buf[PATH_LEN];
+    strncpy(buf, path, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (char *save, *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        struct DirEntry e;
+        if (strlen(comp) >= NAME_LEN || !DirFind(disk, dir->root, comp, &e) || !(e.flags & DIRENT_DIR))
+            return -1;
+        dir->parentRoot = dir->root;
+        dir->isRoot     = 0;
+        strcpy(dir->name, comp);
+        dir->root       = e.firstBlock;
+    }
+    dir->origRoot = dir->root;
+    return 0;
+}
+
+/* Find the entry at path: 1 found, 0 missing, -1 its directory is missing */
+static int LookupPath(FILE *disk, const struct Superblock *sb, const char *path,
+                      struct DirRef *dir, struct DirEntry *e) {
+    char dirPath[PATH_LEN], name[NAME_LEN];
+    struct DirRef tmp;
+    if (!dir) dir = &tmp;
+    if (SplitPath(path, dirPath, name) < 0) return 0;
+    if (OpenDir(disk, sb, dirPath, dir) < 0) return -1;
+    return DirFind(disk, dir->root, name, e);
+}
+
+/* After a directory's tree got a new root, record it where it belongs */
+static void StoreDirRoot(FILE *disk, struct Superblock *sb, struct DirRef *dir) {
+    if (dir->root == dir->origRoot) return;
+    if (dir->isRoot) {
+        sb->rootDir = dir->root;
+        StoreSuperblock(disk, sb);
+    } else {
+        struct DirEntry e;
+        DirFind(disk, dir->parentRoot, dir->name, &e);
+        e.firstBlock = dir->root;
+        DirUpdate(disk, dir->parentRoot, &e);
+    }
+    dir->origRoot = dir->root;
+}
+
+/*
+ * Create an entry at path (e->name is ignored), allocating directory nodes
+ * from fat. Returns 0, -1 if the name is invalid, -2 if its directory is
+ * missing, -3 if the name is taken, -4 if there is no block for a node.
+ * Nothing is changed when it fails.
+ */
+static int AddPath(FILE *disk, uint32_t *fat, struct Superblock *sb, const char *path, const struct DirEntry *e) {
+    char dirPath[PATH_LEN];
+    struct DirEntry rec = *e;
+    struct DirRef dir;
+    if (SplitPath(path, dirPath, rec.name) < 0) return -1;
+    if (OpenDir(disk, sb, dirPath, &dir) < 0) return -2;
+    int r = DirInsert(disk, fat, &dir.root, &rec);
+    if (r < 0) return r == -1 ? -3 : -4;
+    StoreDirRoot(disk, sb, &dir);
+    if (rec.flags & DIRENT_DIR) sb->dirCount++;
+    else                        sb->fileCount++;
+    return 0;
+}
+
+/* Can an entry be created at path? 0, or what AddPath would fail with */
+static int CheckPath(FILE *disk, const struct Superblock *sb, const char *path) {
+    char dirPath[PATH_LEN], name[NAME_LEN];
+    struct DirRef dir;
+    if (SplitPath(path, dirPath, name) < 0) return -1;
+    if (OpenDir(disk, sb, dirPath, &dir) < 0) return -2;
+    if (DirFind(disk, dir.root, name, NULL)) return -3;
+    return 0;
+}
+
+/* Report a failed AddPath/CheckPath */
+static void PathError(int err, const char *path) {
+    if (err == -1)      fprintf(stderr, "Invalid name: %s\n", path);
+    else if (err == -2) fprintf(stderr, "Directory not found: %s\n", path);
+    else if (err == -4) fprintf(stderr, "Not enough free space\n");
+    else                fprintf(stderr, "A file named '%s' already exists\n", path);
+}
+
+/* Remove the entry at path, freeing emptied nodes in fat; 0 or -1 if missing */
+static int RemovePath(FILE *disk, uint32_t *fat, struct Superblock *sb, const char *path, struct DirEntry *removed) {
+    char dirPath[PATH_LEN], name[NAME_LEN];
+    struct DirRef dir;
+    struct DirEntry e;
+    if (SplitPath(path, dirPath, name) < 0 || OpenDir(disk, sb, dirPath, &dir) < 0) return -1;
+    if (DirRemove(disk, fat, &dir.root, name, &e) < 0) return -1;
+    StoreDirRoot(disk, sb, &dir);
+    if (e.flags & DIRENT_DIR) sb->dirCount--;
+    else                      sb->fileCount--;
+    if (removed) *removed = e;
+    return 0;
+}
+
+/*
+ * Change the first block / size / flags / packed data of the entry at
+ * path; 0, -1 if missing, or -4 if there is no block for a node. A record
+ * that outgrows its node is removed and inserted again, taking nodes from
+ * fat; the room for that is checked before the old record goes.
+ */
+static int UpdatePath(FILE *disk, uint32_t *fat, struct Superblock *sb, const char *path, const struct DirEntry *e) {
+    char dirPath[PATH_LEN];
+    struct DirEntry rec = *e;
+    struct DirRef dir;
+    if (SplitPath(path, dirPath, rec.name) < 0 || OpenDir(disk, sb, dirPath, &dir) < 0) return -1;
+    int r = DirUpdate(disk, dir.root, &rec);
+    if (r != -2) return r;
+    if (!TreeRoom(disk, fat, dir.root)) return -4;
+    RemovePath(disk, fat, sb, path, NULL);
+    return AddPath(disk, fat, sb, path, &rec) < 0 ? -1 : 0;
+}
+
+
+/*   Tail blocks   */
+
+/*
+ * A tail block packs the last partial blocks of several small files:
+ *   u32 TAIL_MAGIC, u32 bitmap of used TAIL_UNIT-byte units (unit 0 is
+ *   this header), then the tails
+ * New tails go into the block the superblock points at until it is full.
+ * A tail block returns to the free pool when its last tail is freed; space
+ * freed in older ones comes back with Defragment. Tail blocks are only
+ * touched under the exclusive metadata lock. Callers write the FAT and the
+ * superblock afterwards.
+ */
+#define TAIL_MAGIC  0x4C494154   /* "TAIL" */
+#define TAIL_UNIT   16           /* BLOCK_SIZE / 32: one bit per unit */
+
+static uint32_t TailMask(uint32_t off, uint32_t len) {
+    uint32_t units = (len + TAIL_UNIT - 1) / TAIL_UNIT;
+    return ((1u << units) - 1) << (off / TAIL_UNIT);
+}
+
+/* Bytes of a file kept in its tail block */
+static uint32_t TailBytes(const struct DirEntry *e) {
+    return (e->flags & DIRENT_TAIL) ? e->size % BLOCK_SIZE : 0;
+}
+
+/* Would a file of this size, whose last block holds data, get packed? */
+static int PackKind(uint32_t size) {
+    if (size > 0 && size <= INLINE_MAX)                       return DIRENT_INLINE;
+    if (size % BLOCK_SIZE > 0 && size % BLOCK_SIZE <= TAIL_MAX) return DIRENT_TAIL;
+    return 0;
+}
+
+/*
+ * Pack a file's tail (TailBytes(e) bytes of data) and record where it went
+ * in e. Returns 0, or -1 if a new tail block was needed and none is free.
+ */
+static int TailAlloc(FILE *disk, uint32_t *fat, struct Superblock *sb, const char *data, struct DirEntry *e) {
+    unsigned char buf[BLOCK_SIZE];
+    uint32_t len = e->size % BLOCK_SIZE, bitmap = 0, magic = 0;
+    uint32_t blk = sb->tailBlock;
+    int off = -1;
+
+    // 1) First run of free units in the block being filled
+    if (blk != 0 && fat[blk] == FAT_EOC) {
+        fseek(disk, DATA_OFFSET + (off_t)blk * BLOCK_SIZE, SEEK_SET);
+        fread(buf, 1, BLOCK_SIZE, disk);
+        memcpy(&magic, buf, sizeof(magic));
+        memcpy(&bitmap, buf + 4, sizeof(bitmap));
+    }
+    if (magic == TAIL_MAGIC) {
+        for (uint32_t o = TAIL_UNIT; o + len <= BLOCK_SIZE; o += TAIL_UNIT) {
+            if (!(bitmap & TailMask(o, len))) { off = o; break; }
+        }
+    }
+
+    // 2) ... or a fresh one
+    if (off < 0) {
+        blk = 0;
+        for (int i = 1; i < FAT_ENTRIES; i++) if (fat[i] == 0) { blk = i; break; }
+        if (blk == 0) return -1;
+        fat[blk] = FAT_EOC;
+        memset(buf, 0, BLOCK_SIZE);
+        magic  = TAIL_MAGIC;
+        bitmap = 1;
+        memcpy(buf, &magic, sizeof(magic));
+        off = TAIL_UNIT;
+        sb->tailBlock = blk;
+    }
+
+    bitmap |= TailMask(off, len);
+    memcpy(buf + 4, &bitmap, sizeof(bitmap));
+    memcpy(buf + off, data, len);
+    fseek(disk, DATA_OFFSET + (off_t)blk * BLOCK_SIZE, SEEK_SET);
+    fwrite(buf, 1, BLOCK_SIZE, disk);
+
+    e->flags    |= DIRENT_TAIL;
+    e->tailBlock = blk;
+    e->tailOff   = off;
+    return 0;
+}
+
+/* Read a file's packed tail into buf */
+static void TailRead(FILE *disk, const struct DirEntry *e, char *buf) {
+    fseek(disk, DATA_OFFSET + (off_t)e->tailBlock * BLOCK_SIZE + e->tailOff, SEEK_SET);
+    fread(buf, 1, TailBytes(e), disk);
+}
+
+/*
+ * Give back a file's tail units. Returns the tail block if that emptied
+ * it (it is then free in fat), else 0.
+ */
+static uint32_t TailFree(FILE *disk, uint32_t *fat, struct Superblock *sb, const struct DirEntry *e) {
+    if (!(e->flags & DIRENT_TAIL)) return 0;
+    uint32_t bitmap;
+    off_t pos = DATA_OFFSET + (off_t)e->tailBlock * BLOCK_SIZE + 4;
+    fseek(disk, pos, SEEK_SET);
+    fread(&bitmap, sizeof(bitmap), 1, disk);
+    bitmap &= ~TailMask(e->tailOff, TailBytes(e));
+    fseek(disk, pos, SEEK_SET);
+    fwrite(&bitmap, sizeof(bitmap), 1, disk);
+    if (bitmap != 1) return 0;
+
+    fat[e->tailBlock] = 0;
+    if (sb->tailBlock == e->tailBlock) sb->tailBlock = 0;
+    return e->tailBlock;
+}
+
+
+/*
+ * Read a snapshot back from its block chain: the frozen FAT, then a u32
+ * record count and one record per path, parents before children:
+ *   u8 flags, u8 unused, u16 pathLen, u32 firstBlock, u32 size, path,
+ *   then the packed part of the entry as in a leaf record
+ */
+static struct PathEntry *LoadSnapshot(FILE *disk, const uint32_t *fat, uint32_t metaBlock,
+                                      uint32_t *snapFat, int *count) {
+    size_t cap = 64 * BLOCK_SIZE, len = 0;
+    char *meta = malloc(cap);
+    if (!meta) { perror("Allocating snapshot buffer"); exit(EXIT_FAILURE); }
+    for (uint32_t cur = metaBlock; ; cur = fat[cur]) {
+        if (len == cap) {
+            cap *= 2;
+            meta = realloc(meta, cap);
+            if (!meta) { perror("Allocating snapshot buffer"); exit(EXIT_FAILURE); }
+        }
+        fseek(disk, DATA_OFFSET + (off_t)cur * BLOCK_SIZE, SEEK_SET);
+        fread(meta + len, 1, BLOCK_SIZE, disk);
+        len += BLOCK_SIZE;
+        if (fat[cur] == FAT_EOC) break;
+    }
+    memcpy(snapFat, meta, FAT_ENTRIES * sizeof(uint32_t));
+
+    const char *p = meta + FAT_ENTRIES * sizeof(uint32_t);
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    p += 4;
+    struct PathEntry *list = calloc(n ? n : 1, sizeof(struct PathEntry));
+    if (!list) { perror("Allocating snapshot buffer"); exit(EXIT_FAILURE); }
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t pathLen;
+        list[i].e.flags = (uint8_t)p[0];
+        memcpy(&pathLen, p + 2, sizeof(pathLen));
+        memcpy(&list[i].e.firstBlock, p + 4, sizeof(uint32_t));
+        memcpy(&list[i].e.size, p + 8, sizeof(uint32_t));
+        p += 12;
+        list[i].path = malloc(pathLen + 1);
+        if (!list[i].path) { perror("Allocating snapshot buffer"); exit(EXIT_FAILURE); }
+        memcpy(list[i].path, p, pathLen);
+        list[i].path[pathLen] = '\0';
+        p += pathLen;
+        if (list[i].e.flags & DIRENT_TAIL) {
+            memcpy(&list[i].e.tailBlock, p, sizeof(uint32_t));
+            memcpy(&list[i].e.tailOff, p + 4, sizeof(uint16_t));
+        } else if (list[i].e.flags & DIRENT_INLINE) {
+            memcpy(list[i].e.data, p, list[i].e.size);
+        }
+        p += ExtraBytes(&list[i].e);
+        const char *slash = strrchr(list[i].path, '/');
+        strcpy(list[i].e.name, slash ? slash + 1 : list[i].path);
+        for (const char *c = list[i].path; *c; c++) list[i].depth += *c == '/';
+    }
+    free(meta);
+    *count = n;
+    return list;
+}
+
+/*
+ * Mark every block a snapshot still needs: the blocks holding the snapshot
+ * itself and the blocks of every file it froze (followed through the
+ * snapshot's own copy of the FAT), tail blocks included. This reads every
+ * snapshot; mutations use the bitmap StorePinned keeps instead.
+ */
+static void ScanPinned(FILE *disk, const uint32_t *fat, const struct Superblock *sb, uint8_t *pinned) {
+    memset(pinned, 0, FAT_ENTRIES);
+    if (sb->snapCount == 0) return;
+
+    uint32_t *snapFat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!snapFat) { perror("Allocating snapshot buffers"); exit(EXIT_FAILURE); }
+
+    for (uint32_t s = 0; s < sb->snapCount; s++) {
+        for (uint32_t cur = sb->snaps[s].metaBlock; ; cur = fat[cur]) {
+            pinned[cur] = 1;
+            if (fat[cur] == FAT_EOC) break;
+        }
+
+        int count;
+        struct PathEntry *list = LoadSnapshot(disk, fat, sb->snaps[s].metaBlock, snapFat, &count);
+        for (int i = 0; i < count; i++) {
+            uint32_t firstBlock = list[i].e.firstBlock;
+            if (list[i].e.flags & DIRENT_TAIL) pinned[list[i].e.tailBlock] = 1;
+            if ((list[i].e.flags & DIRENT_DIR) || firstBlock == 0 || firstBlock == FAT_EOC) continue;
+            for (uint32_t cur = LINK_BLOCK(firstBlock); ; cur = LINK_BLOCK(snapFat[cur])) {
+                pinned[cur] = 1;
+                if (snapFat[cur] == FAT_EOC) break;
+            }
+        }
+        FreeTree(list, count);
+    }
+    free(snapFat);
+}
+
+/*
+ * The pinned set only changes when a snapshot is taken or dropped, so
+ * those record it as a one-block bitmap (one bit per FAT entry) that the
+ * superblock points at. The bitmap block pins itself and is released with
+ * the last snapshot. If no block is free for it, pinnedBlock stays 0 and
+ * LoadPinned walks the snapshots as images without the bitmap need.
+ */
+_Static_assert(FAT_ENTRIES / 8 <= BLOCK_SIZE, "pinned bitmap must fit in one block");
+
+static void StorePinned(FILE *disk, uint32_t *fat, struct Superblock *sb, uint8_t *pinned) {
+    if (sb->snapCount == 0) { sb->pinnedBlock = 0; return; }
+
+    uint32_t blk = sb->pinnedBlock;
+    if (blk == 0) {
+        for (int b = 1; b < FAT_ENTRIES; b++) {
+            if (fat[b] == 0 && !pinned[b]) { blk = b; break; }
+        }
+        if (blk == 0) return;
+    }
+    pinned[blk] = 1;
+    fat[blk] = FAT_SNAPSHOT;
+
+    uint8_t bits[BLOCK_SIZE] = {0};
+    for (int b = 0; b < FAT_ENTRIES; b++) {
+        if (pinned[b]) bits[b / 8] |= 1 << (b % 8);
+    }
+    fseek(disk, DATA_OFFSET + (off_t)blk * BLOCK_SIZE, SEEK_SET);
+    if (fwrite(bits, 1, BLOCK_SIZE, disk) != BLOCK_SIZE) {
+        perror("Failed to write pinned bitmap");
+        exit(EXIT_FAILURE);
+    }
+    sb->pinnedBlock = blk;
+}
+
+/* The blocks snapshots pin: one block read, or a walk over every snapshot */
+static void LoadPinned(FILE *disk, const uint32_t *fat, const struct Superblock *sb, uint8_t *pinned) {
+    if (sb->snapCount == 0 || sb->pinnedBlock == 0) {
+        ScanPinned(disk, fat, sb, pinned);
+        return;
+    }
+    uint8_t bits[BLOCK_SIZE];
+    fseek(disk, DATA_OFFSET + (off_t)sb->pinnedBlock * BLOCK_SIZE, SEEK_SET);
+    if (fread(bits, 1, BLOCK_SIZE, disk) != BLOCK_SIZE) {
+        perror("Failed to read pinned bitmap");
+        exit(EXIT_FAILURE);
+    }
+    for (int b = 0; b < FAT_ENTRIES; b++) pinned[b] = (bits[b / 8] >> (b % 8)) & 1;
+}
+
+/* Keep pinned blocks out of the free pool, and return unpinned ones to it */
+static void ApplyPinned(uint32_t *fat, const uint8_t *pinned) {
+    for (int b = 1; b < FAT_ENTRIES; b++) {
+        if (fat[b] == 0 && pinned[b])                  fat[b] = FAT_SNAPSHOT;
+        else if (fat[b] == FAT_SNAPSHOT && !pinned[b]) fat[b] = 0;
+    }
+}
+
+/*
+ * Follow a file's chain: store its data blocks in order and, for each, how
+ * many hole blocks precede it. Returns the number of data blocks.
+ */
+static int LoadChain(const uint32_t *fat, uint32_t firstBlock, uint32_t *blocks, uint32_t *holes) {
+    int n = 0;
+    if (firstBlock == 0 || firstBlock == FAT_EOC) return 0;
+
+    uint32_t link = firstBlock;
+    while (1) {
+        uint32_t cur = LINK_BLOCK(link);
+        blocks[n] = cur;
+        holes[n]  = LINK_HOLES(link);
+        n++;
+        if (fat[cur] == FAT_EOC || n == FAT_ENTRIES) break;
+        link = fat[cur];
+    }
+    return n;
+}
+
+/*
+ * True if the buffer holds only zero bytes. Comparing the buffer against
+ * itself shifted by one byte lets the (vectorized) libc memcmp do the scan.
+ */
+static int IsZeroBlock(const char *buf, size_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/*
+ * Release a run of data blocks without writing them: punch a hole in an
+ * image file, or discard the range on a block device. Falls back to
+ * writing zeros when neither is supported.
+ */
+static void ReleaseBlocks(FILE *disk, uint32_t first, uint32_t count) {
+    struct Volume plain, *v = VolumeOf(disk, &plain);
+    struct MemberJob jobs[MAX_MEMBERS];
+    memset(jobs, 0, sizeof(jobs));
+    fflush(disk);
+
+    // On a volume the run is spread over the members
+    MapRange(v, jobs, DATA_OFFSET + (off_t)first * BLOCK_SIZE, NULL, (size_t)count * BLOCK_SIZE);
+    for (int m = 0; m < v->members; m++) {
+        int fd = jobs[m].fd;
+        for (int i = 0; i < jobs[m].count; i++) {
+            off_t off = jobs[m].pieces[i].off;
+            off_t len = jobs[m].pieces[i].len;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+                uint64_t range[2] = { (uint64_t)off, (uint64_t)len };
+                if (ioctl(fd, BLKDISCARD, range) == 0) continue;
+            } else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+                continue;
+            }
+            char *zeros = PoolGet();
+            struct MemberJob zero = { .fd = fd, .align = jobs[m].align };
+            memset(zeros, 0, IO_BUF_SIZE);
+            const off_t chunk = IO_BUF_SIZE;
+            for (off_t b = 0; b < len; b += chunk)
+                AddPiece(&zero, off + b, zeros, len - b < chunk ? len - b : chunk);
+            if (RunJobs(&zero, 1, 1) < 0) {
+                perror("Error releasing disk blocks");
+                exit(EXIT_FAILURE);
+            }
+            PoolPut(zeros);
+        }
+        free(jobs[m].pieces);
+    }
+}
+
+static int compare_block(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Release scattered blocks, one call per contiguous run (sorts the list) */
+static void ReleaseBlockList(FILE *disk, uint32_t *blocks, int n) {
+    qsort(blocks, n, sizeof(uint32_t), compare_block);
+    for (int i = 0; i < n; ) {
+        int j = i;
+        while (j + 1 < n && blocks[j+1] == blocks[j] + 1) j++;
+        ReleaseBlocks(disk, blocks[i], j - i + 1);
+        i = j + 1;
+    }
+}
+
+/**
+ * Format the disk image:
+ *  - Zero out the FAT region, except entry[0] = 0xFFFFFFFF
+ *  - Write an empty superblock (empty root directory) into data block 0
+ * all with a single write; with --discard the data blocks are released too.
+ */
+void Format(const char *disk_path) {
+    if (stripeSize == 0 || stripeSize % BLOCK_SIZE != 0) {
+        fprintf(stderr, "Stripe size must be a multiple of %d bytes\n", BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    FILE *fp = OpenVolume(disk_path, "r+b", 1);
+    if (!fp) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(fp, F_WRLCK, 0, 0);
+
+    // Make sure we start at the very beginning
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+        perror("fseek failed");
+        fclose(fp);
+        exit(EXIT_FAILURE);
+    }
+
+    // 1) Build the whole metadata region in memory:
+    //    FAT (entry[0] reserved), empty superblock
+    char *meta = calloc(1, META_END);
+    if (!meta) { perror("Allocating metadata"); fclose(fp); exit(EXIT_FAILURE); }
+    uint32_t entry = FAT_EOC;
+    memcpy(meta, &entry, sizeof(entry));
+    struct Superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic       = SB_MAGIC;
+    sb.counted     = 1;
+    sb.freeBlocks  = FAT_ENTRIES - 1;
+    sb.largestFree = FAT_ENTRIES - 1;
+    struct Volume plain, *v = VolumeOf(fp, &plain);
+    if (strncmp(disk_path, "vol:", 4) == 0) {
+        sb.members      = v->members;
+        sb.stripeBlocks = v->stripe;
+    }
+    memcpy(meta + DATA_OFFSET, &sb, sizeof(sb));
+
+    // 2) ... and write it in one go
+    if (fwrite(meta, 1, META_END, fp) != (size_t)META_END) {
+        perror("Failed to write metadata");
+        free(meta);
+        fclose(fp);
+        exit(EXIT_FAILURE);
+    }
+    free(meta);
+
+    // 3) --discard: release every data block instead of leaving old contents
+    if (discardMode) ReleaseBlocks(fp, 1, FAT_ENTRIES - 1);
+
+    fclose(fp);
+    printf("Disk image \"%s\" formatted successfully.\n", disk_path);
+}
+
+
+/*
+ * Scan a host file once. isData[j] tells whether file block j carries data
+ * (1), is a hole (0), or must be stored as an explicit zero block because a
+ * link cannot skip that many holes (2). The data blocks are returned packed
+ * in order (the image cannot hold more than FAT_ENTRIES of them anyway).
+ * Returns the number of blocks to store, zero blocks included.
+ */
+static int ScanSource(int src, off_t filesize, uint8_t **isDataOut, char **dataOut) {
+    uint32_t blocks = (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint8_t *isData = calloc(blocks ? blocks : 1, 1);
+    char *data = malloc(BLOCK_SIZE);
+    if (!isData || !data) { perror("Allocating scan buffers"); exit(EXIT_FAILURE); }
+    int dataBlocks = 0, dataCap = 1;
+    char buffer[BLOCK_SIZE];
+    off_t pos = 0;
+    while (pos < filesize) {
+        // Jump over holes the host file system already knows about
+        off_t dataPos = lseek(src, pos, SEEK_DATA);
+        if (dataPos < 0 && errno == ENXIO) break;   // only holes left
+        if (dataPos < 0) dataPos = pos;             // SEEK_DATA not supported
+        off_t holePos = lseek(src, dataPos, SEEK_HOLE);
+        if (holePos < 0 || holePos > filesize) holePos = filesize;
+
+        for (uint32_t j = dataPos / BLOCK_SIZE; j < blocks && (off_t)j * BLOCK_SIZE < holePos; j++) {
+            size_t to_read = BLOCK_SIZE;
+            if (j == blocks - 1 && filesize % BLOCK_SIZE) to_read = filesize % BLOCK_SIZE;
+            // zero-pad remainder
+            memset(buffer, 0, BLOCK_SIZE);
+            if (pread(src, buffer, to_read, (off_t)j * BLOCK_SIZE) < 0) {
+                perror("Error reading source file");
+                exit(EXIT_FAILURE);
+            }
+            if (IsZeroBlock(buffer, BLOCK_SIZE)) continue;
+
+            if (dataBlocks == FAT_ENTRIES) {
+                fprintf(stderr, "Not enough free space\n");
+                exit(EXIT_FAILURE);
+            }
+            if (dataBlocks == dataCap) {
+                dataCap *= 2;
+                data = realloc(data, (size_t)dataCap * BLOCK_SIZE);
+                if (!data) { perror("Allocating data buffer"); exit(EXIT_FAILURE); }
+            }
+            memcpy(data + (size_t)dataBlocks * BLOCK_SIZE, buffer, BLOCK_SIZE);
+            isData[j] = 1;
+            dataBlocks++;
+        }
+        pos = (holePos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+
+    // A link counts at most MAX_HOLE_RUN holes: break longer runs in front
+    // of a data block with an explicit zero block (isData = 2)
+    uint32_t run = 0;
+    int seen = 0;
+    for (uint32_t j = blocks; j-- > 0; ) {
+        if (isData[j]) { seen = 1; run = 0; }
+        else if (seen && ++run > MAX_HOLE_RUN) { isData[j] = 2; dataBlocks++; run = 0; }
+    }
+
+    *isDataOut = isData;
+    *dataOut   = data;
+    return dataBlocks;
+}
+
+/*
+ * Blocks of a host file covered by its data extents, from SEEK_DATA/
+ * SEEK_HOLE alone (every block if those are not supported). Nothing is
+ * read: all-zero blocks inside an extent still count.
+ */
+static uint32_t ExtentBlocks(int src, off_t filesize) {
+    uint32_t count = 0;
+    off_t pos = 0;
+    while (pos < filesize) {
+        off_t dataPos = lseek(src, pos, SEEK_DATA);
+        if (dataPos < 0 && errno == ENXIO) break;
+        if (dataPos < 0) dataPos = pos;
+        off_t holePos = lseek(src, dataPos, SEEK_HOLE);
+        if (holePos < 0 || holePos > filesize) holePos = filesize;
+        off_t first = dataPos / BLOCK_SIZE;
+        pos = (holePos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        count += pos / BLOCK_SIZE - first;
+    }
+    return count;
+}
+
+
+/**
+ * Write a host file into the disk image under a given path.
+ * All-zero blocks, and holes the host file system reports through
+ * SEEK_DATA/SEEK_HOLE, are stored as holes and take no data block.
+ * Small files are kept inline in their entry or get their last partial
+ * block packed into a tail block.
+ */
+void Write(const char *disk_path, const char *srcPath, const char *destFileName) {
+    // Open source file
+    int src = open(srcPath, O_RDONLY);
+    if (src < 0) { perror("Error opening source file"); exit(EXIT_FAILURE); }
+    // Determine file size
+    off_t filesize = lseek(src, 0, SEEK_END);
+    if (filesize < 0 || filesize > (off_t)UINT32_MAX) {
+        fprintf(stderr, "Source file too large: %s\n", srcPath);
+        close(src);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t blocks = (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // Open disk image
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+
+    // Refuse a file that cannot fit before reading any of it: the
+    // superblock counters against the blocks its data extents cover
+    struct Superblock sb;
+    LockRegion(disk, F_RDLCK, 0, META_END);
+    LoadSuperblock(disk, &sb);
+    LockRegion(disk, F_UNLCK, 0, META_END);
+    uint32_t extents = ExtentBlocks(src, filesize);
+    if (sb.counted && extents > sb.freeBlocks) {
+        fprintf(stderr, "Not enough free space: %u blocks needed, %u free\n",
+                extents, sb.freeBlocks);
+        close(src); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Scan the source once, keeping only the blocks that carry data
+    uint8_t *isData;
+    char *data;
+    int dataBlocks = ScanSource(src, filesize, &isData, &data);
+    close(src);
+    uint32_t holeBlocks = blocks - dataBlocks;
+
+    // A small file's last data block is packed instead of getting a block
+    int pack = (dataBlocks > 0 && isData[blocks - 1] == 1) ? PackKind(filesize) : 0;
+    const char *tail = NULL;
+    if (pack) {
+        tail = data + (size_t)(dataBlocks - 1) * BLOCK_SIZE;
+        isData[blocks - 1] = 0;
+        dataBlocks--;
+    }
+
+    // Keep Defragment from moving blocks until our data is in place; other
+    // writers share this lock and copy their data in parallel
+    LockRegion(disk, F_RDLCK, META_END, 0);
+
+    // Allocation runs under an exclusive metadata lock
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    // Read FAT and superblock into memory
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); fclose(disk); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    LoadSuperblock(disk, &sb);
+
+    // The path must be free before any data is copied (checked again at commit)
+    int err = CheckPath(disk, &sb, destFileName);
+    if (err < 0) {
+        PathError(err, destFileName);
+        free(fat); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Find empty blocks for the data blocks only
+    uint32_t *chain = malloc((dataBlocks ? dataBlocks : 1) * sizeof(uint32_t));
+    if (!chain) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    int found = 0;
+    for (int i = 1; i < FAT_ENTRIES && found < dataBlocks; i++) {
+        if (fat[i] == 0) chain[found++] = i;
+    }
+    if (found < dataBlocks) {
+        fprintf(stderr, "Not enough free space\n");
+        free(fat); free(chain); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Update FAT entries: each link also counts the holes it skips.
+    // The chain is ours once it is in the FAT, even before it has a name.
+    uint32_t fb = FAT_EOC;
+    uint32_t holes = 0;
+    int k = 0;
+    for (uint32_t j = 0; j < blocks; j++) {
+        if (!isData[j]) { holes++; continue; }
+        uint32_t link = MAKE_LINK(chain[k], holes);
+        if (k == 0) fb = link;
+        else        fat[chain[k-1]] = link;
+        holes = 0;
+        k++;
+    }
+    if (dataBlocks > 0) fat[chain[dataBlocks - 1]] = FAT_EOC;
+
+    // Write updated FAT back
+    StoreFAT(disk, fat, &sb);
+    LockRegion(disk, F_UNLCK, 0, META_END);
+
+    // Write file data blocks (no metadata lock held), on every member of
+    // a volume at once
+    static char zeroBlock[BLOCK_SIZE];
+    char **bufs = malloc((dataBlocks ? dataBlocks : 1) * sizeof(char *));
+    if (!bufs) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    char *next = data;
+    k = 0;
+    for (uint32_t j = 0; j < blocks; j++) {
+        if (!isData[j]) continue;
+        bufs[k++] = isData[j] == 1 ? next : zeroBlock;
+        if (isData[j] == 1) next += BLOCK_SIZE;
+    }
+    TransferBlocks(disk, chain, dataBlocks, bufs, 1);
+    free(bufs);
+
+    // Commit the directory entry: the tree may have changed meanwhile
+    LockRegion(disk, F_WRLCK, 0, META_END);
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    LoadSuperblock(disk, &sb);
+    struct DirEntry entry = { .flags = 0, .firstBlock = fb, .size = (uint32_t)filesize };
+    int full = 0;
+    if (pack == DIRENT_INLINE) {
+        entry.flags = DIRENT_INLINE;
+        memcpy(entry.data, tail, filesize);
+    } else if (pack == DIRENT_TAIL) {
+        full = TailAlloc(disk, fat, &sb, tail, &entry) < 0;
+    }
+    err = full ? 0 : AddPath(disk, fat, &sb, destFileName, &entry);
+    if (full || err < 0) {
+        // no room for the tail, or someone took the name (or removed the
+        // directory) while we copied
+        for (k = 0; k < dataBlocks; k++) fat[chain[k]] = 0;
+        if (!full) TailFree(disk, fat, &sb, &entry);
+    }
+    StoreFAT(disk, fat, &sb);
+    LockRegion(disk, F_UNLCK, 0, 0);
+    if (full) {
+        fprintf(stderr, "Not enough free space\n");
+        exit(EXIT_FAILURE);
+    }
+    if (err < 0) {
+        PathError(err, destFileName);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *packed = pack == DIRENT_TAIL ? " + tail" : "";
+    if (pack == DIRENT_INLINE)
+        printf("Copied '%s' -> '%s' (size: %ld bytes, inline)\n",
+               srcPath, destFileName, (long)filesize);
+    else if (holeBlocks > 0)
+        printf("Copied '%s' -> '%s' (size: %ld bytes, %d blocks%s, %u holes)\n",
+               srcPath, destFileName, (long)filesize, dataBlocks, packed, holeBlocks);
+    else
+        printf("Copied '%s' -> '%s' (size: %ld bytes, %d blocks%s)\n",
+               srcPath, destFileName, (long)filesize, dataBlocks, packed);
+
+    free(fat);
+    free(chain);
+    free(isData);
+    free(data);
+    fclose(disk);
+}
+
+
+/* Skip len bytes of the destination: a seek leaves a real hole, a pipe gets zeros */
+static void WriteHole(int dest, int seekable, off_t len) {
+    static const char zeroBlock[BLOCK_SIZE] = {0};
+    if (seekable) {
+        lseek(dest, len, SEEK_CUR);
+        return;
+    }
+    while (len > 0) {
+        size_t n = len < BLOCK_SIZE ? (size_t)len : BLOCK_SIZE;
+        if (write(dest, zeroBlock, n) < 0) { perror("Error writing destination file"); exit(EXIT_FAILURE); }
+        len -= n;
+    }
+}
+
+/**
+ * Read a file from the disk image back to the destination.
+ * Holes are recreated as sparse regions of the destination file.
+ */
+void Read(const char *disk_path, const char *srcFileName, const char *destPath) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    // Find the entry
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirEntry entry;
+    if (LookupPath(disk, &sb, srcFileName, NULL, &entry) != 1) {
+        fprintf(stderr, "File not found: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    if (entry.flags & DIRENT_DIR) {
+        fprintf(stderr, "Is a directory: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t filesize = entry.size;
+
+    // A packed file ends in its entry or tail block
+    char packed[BLOCK_SIZE];
+    uint32_t packedLen = 0;
+    if (entry.flags & DIRENT_INLINE) {
+        packedLen = entry.size;
+        memcpy(packed, entry.data, packedLen);
+    } else if (entry.flags & DIRENT_TAIL) {
+        packedLen = TailBytes(&entry);
+        TailRead(disk, &entry, packed);
+    }
+
+    // Load FAT and walk the chain (inline files have none)
+    uint32_t *fat    = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *chain  = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *holes  = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat || !chain || !holes) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    int n = 0;
+    if (entry.firstBlock != FAT_EOC) {
+        fseek(disk, 0, SEEK_SET);
+        fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+        n = LoadChain(fat, entry.firstBlock, chain, holes);
+    }
+
+    // Open destination file
+    int dest = open(destPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest < 0) { perror("Error creating destination file"); exit(EXIT_FAILURE); }
+    int seekable = lseek(dest, 0, SEEK_CUR) >= 0;
+
+    // Fetch all data blocks in one go (every member of a volume at once),
+    // then copy them out, skipping over holes
+    char *data  = PoolGet();
+    char **bufs = malloc((n ? n : 1) * sizeof(char *));
+    if (!bufs) { perror("Allocating buffer"); exit(EXIT_FAILURE); }
+    for (int k = 0; k < n; k++) bufs[k] = data + (size_t)k * BLOCK_SIZE;
+    if (n > 0) TransferBlocks(disk, chain, n, bufs, 0);
+
+    size_t remaining = filesize - packedLen;
+    for (int k = 0; k < n && remaining > 0; k++) {
+        off_t hole = (off_t)holes[k] * BLOCK_SIZE;
+        if (hole > (off_t)remaining) hole = remaining;
+        WriteHole(dest, seekable, hole);
+        remaining -= hole;
+
+        size_t to_read = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+        if (write(dest, bufs[k], to_read) < 0) { perror("Error writing destination file"); exit(EXIT_FAILURE); }
+        remaining -= to_read;
+    }
+    free(bufs);
+    PoolPut(data);
+
+    // Trailing holes: setting the size is enough on a regular file,
+    // unless the packed tail still follows them
+    if (packedLen > 0 || !seekable) WriteHole(dest, seekable, remaining);
+    if (packedLen > 0 && write(dest, packed, packedLen) < 0) {
+        perror("Error writing destination file");
+        exit(EXIT_FAILURE);
+    }
+    if (seekable && ftruncate(dest, filesize) < 0) {
+        perror("Error sizing destination file");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Read '%s' (%u bytes) -> '%s'\n", srcFileName, filesize, destPath);
+
+    close(dest);
+    fclose(disk);
+    free(fat);
+    free(chain);
+    free(holes);
+}
+
+
+/* Delete: remove file and free its blocks */
+void Delete(const char *disk_path, const char *filename) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    // Locate the entry
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirEntry entry;
+    if (LookupPath(disk, &sb, filename, NULL, &entry) != 1) {
+        fprintf(stderr, "File not found: %s\n", filename);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    if (entry.flags & DIRENT_DIR) {
+        fprintf(stderr, "Is a directory (use -rmdir): %s\n", filename);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t firstBlock = entry.firstBlock;
+
+    // Load FAT and drop the entry (directory nodes it empties are freed)
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    RemovePath(disk, fat, &sb, filename, NULL);
+
+    // Traverse and clear the chain (holes own no blocks), and give back
+    // the tail's share of its tail block
+    uint32_t *freed = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!freed) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    int freedCount = 0;
+    uint32_t tailBlk = TailFree(disk, fat, &sb, &entry);
+    if (tailBlk) freed[freedCount++] = tailBlk;
+    if (firstBlock != FAT_EOC) {
+        uint32_t cur = LINK_BLOCK(firstBlock);
+        while (1) {
+            uint32_t next = fat[cur];
+            fat[cur] = 0;
+            freed[freedCount++] = cur;
+            if (next == FAT_EOC)
+                break;
+            cur = LINK_BLOCK(next);
+        }
+    }
+
+    // Blocks a snapshot still references stay out of the free pool
+    if (sb.snapCount > 0) {
+        uint8_t pinned[FAT_ENTRIES];
+        LoadPinned(disk, fat, &sb, pinned);
+        ApplyPinned(fat, pinned);
+    }
+
+    // --discard: hand the freed blocks back to the device (still under the
+    // metadata lock, so nobody can have reallocated them yet)
+    if (discardMode) {
+        int n = 0;
+        for (int i = 0; i < freedCount; i++) {
+            if (fat[freed[i]] == 0) freed[n++] = freed[i];
+        }
+        ReleaseBlockList(disk, freed, n);
+    }
+    free(freed);
+
+    // Write updated FAT back
+    StoreFAT(disk, fat, &sb);
+
+    fclose(disk);
+    free(fat);
+    printf("Deleted file '%s' successfully.\n", filename);
+}
+
+/* List: print the visible entries of a directory ("" = root), in name order */
+void List(const char *disk_path, const char *dirPath) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirRef dir;
+    if (OpenDir(disk, &sb, dirPath, &dir) < 0) {
+        fprintf(stderr, "Directory not found: %s\n", dirPath);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    int count;
+    struct DirEntry *entries = LoadDir(disk, dir.root, &count, NULL);
+    for (int i = 0; i < count; i++) {
+        // Skip hidden names
+        if (entries[i].name[0] == '.') continue;
+        if (entries[i].flags & DIRENT_DIR) printf("%s/\t<dir>\n", entries[i].name);
+        else                               printf("%s\t%u bytes\n", entries[i].name, entries[i].size);
+    }
+    free(entries);
+    fclose(disk);
+}
+
+
+
+/*   Sort      */
+
+/* short struct to hold name+size */
+struct FileInfo {
+    char     name[NAME_LEN];
+    uint32_t size;
+};
+
+/* comparison for qsort: ascending by size */
+static int compare_size(const void *a, const void *b) {
+    const struct FileInfo *fa = a;
+    const struct FileInfo *fb = b;
+    if (fa->size < fb->size) return -1;
+    if (fa->size > fb->size) return  1;
+    return 0;
+}
+
+void Sort(const char *disk_path, const char *dirPath) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirRef dir;
+    if (OpenDir(disk, &sb, dirPath, &dir) < 0) {
+        fprintf(stderr, "Directory not found: %s\n", dirPath);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    int total;
+    struct DirEntry *entries = LoadDir(disk, dir.root, &total, NULL);
+    fclose(disk);
+
+    struct FileInfo *files = malloc((total ? total : 1) * sizeof(struct FileInfo));
+    if (!files) { perror("Allocating file list"); exit(EXIT_FAILURE); }
+    int count = 0;
+    for (int i = 0; i < total; i++) {
+        /* skip hidden files and directories */
+        if (entries[i].name[0] == '.' || (entries[i].flags & DIRENT_DIR))
+            continue;
+
+        /* store */
+        strcpy(files[count].name, entries[i].name);
+        files[count].size = entries[i].size;
+        count++;
+    }
+    free(entries);
+
+    /* sort by size */
+    qsort(files, count, sizeof(files[0]), compare_size);
+
+    /* print sorted */
+    for (int i = 0; i < count; i++) {
+        printf("%s\t%u bytes\n", files[i].name, files[i].size);
+    }
+    free(files);
+}
+
+/* Rename or move an entry; a directory takes its whole subtree along */
+void RenameFile(const char *disk_path, const char *srcFileName, const char *newFileName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+
+    // Locate the entry for srcFileName
+    struct DirEntry entry;
+    if (LookupPath(disk, &sb, srcFileName, NULL, &entry) != 1) {
+        fprintf(stderr, "File not found: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Ensure the new path is free, and not inside the directory being moved
+    int err = CheckPath(disk, &sb, newFileName);
+    if (err < 0) {
+        PathError(err, newFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    size_t srcLen = strlen(srcFileName);
+    while (srcLen > 0 && srcFileName[srcLen-1] == '/') srcLen--;
+    if ((entry.flags & DIRENT_DIR) && strncmp(newFileName, srcFileName, srcLen) == 0 &&
+        newFileName[srcLen] == '/') {
+        fprintf(stderr, "Cannot move a directory into itself: %s\n", newFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Link the entry under the new name first: if that fails, the old
+    // name is still there
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    err = AddPath(disk, fat, &sb, newFileName, &entry);
+    if (err < 0) {
+        PathError(err, newFileName);
+        free(fat); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    RemovePath(disk, fat, &sb, srcFileName, NULL);
+    StoreFAT(disk, fat, &sb);
+
+    printf("Renamed '%s' -> '%s'\n", srcFileName, newFileName);
+    free(fat);
+    fclose(disk);
+}
+
+void Duplicate(const char *disk_path, const char *srcFileName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+
+    // Shared data lock for the whole copy keeps Defragment away; the
+    // metadata is locked exclusively only to allocate and to commit
+    LockRegion(disk, F_RDLCK, META_END, 0);
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+
+    // 1) Find source entry
+    struct DirEntry entry;
+    if (LookupPath(disk, &sb, srcFileName, NULL, &entry) != 1) {
+        fprintf(stderr, "File not found: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    if (entry.flags & DIRENT_DIR) {
+        fprintf(stderr, "Is a directory: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t filesize = entry.size;
+
+    // 2) Build new path = srcFileName + "_copy", next to the source
+    char newName[PATH_LEN];
+    snprintf(newName, sizeof(newName), "%s_copy", srcFileName);
+
     // 2a) Ensure no collision
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char exist[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(exist, 1, 248, disk);
-        if (strcmp(exist, newName) == 0) {
-            fprintf(stderr, "A file named '%s' already exists\n", newName);
+    int err = CheckPath(disk, &sb, newName);
+    if (err < 0) {
+        PathError(err, newName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 3) Load FAT
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+
+    // 4) Walk the source chain: its data blocks and the holes between them
+    uint32_t *srcChain = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *srcHoles = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!srcChain || !srcHoles) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    int blocks = LoadChain(fat, entry.firstBlock, srcChain, srcHoles);
+
+    // 5) Find free blocks
+    uint32_t *chain = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+    int found = 0;
+    for (int i = 1; i < FAT_ENTRIES && found < blocks; i++) {
+        if (fat[i] == 0) chain[found++] = i;
+    }
+    if (found < blocks) {
+        fprintf(stderr, "Not enough free space\n");
+        free(fat); free(srcChain); free(srcHoles); free(chain);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 6) Update FAT chain, keeping the source's holes. The chain is ours
+    //    once it is in the FAT, even before it has a name.
+    for (int j = 0; j < blocks - 1; j++)
+        fat[chain[j]] = MAKE_LINK(chain[j+1], srcHoles[j+1]);
+    if (blocks > 0) fat[chain[blocks-1]] = FAT_EOC;
+    StoreFAT(disk, fat, &sb);
+
+    // 7) Copy data blocks: read them all, then write them all, each on
+    //    every member of a volume at once. A shared metadata lock is
+    //    enough to keep the source chain from being freed or reused.
+    LockRegion(disk, F_RDLCK, 0, META_END);
+    char buffer[BLOCK_SIZE];
+    if (entry.flags & DIRENT_TAIL) TailRead(disk, &entry, buffer);
+    char *data  = PoolGet();
+    char **bufs = malloc((blocks ? blocks : 1) * sizeof(char *));
+    if (!bufs) { perror("Allocating buffer"); exit(EXIT_FAILURE); }
+    for (int j = 0; j < blocks; j++) bufs[j] = data + (size_t)j * BLOCK_SIZE;
+    if (blocks > 0) {
+        TransferBlocks(disk, srcChain, blocks, bufs, 0);
+        TransferBlocks(disk, chain, blocks, bufs, 1);
+    }
+    free(bufs);
+    PoolPut(data);
+    LockRegion(disk, F_UNLCK, 0, META_END);
+
+    // 8) Commit under the exclusive lock again: the tree may have changed
+    //    meanwhile. An inline copy is complete as it is; a packed tail
+    //    gets units of its own.
+    LockRegion(disk, F_WRLCK, 0, META_END);
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    LoadSuperblock(disk, &sb);
+    struct DirEntry copy = entry;
+    copy.firstBlock = blocks > 0 ? MAKE_LINK(chain[0], srcHoles[0]) : FAT_EOC;
+    int full = 0;
+    if (entry.flags & DIRENT_TAIL) {
+        copy.flags &= ~DIRENT_TAIL;
+        full = TailAlloc(disk, fat, &sb, buffer, &copy) < 0;
+    }
+
+    // 9) Commit the new entry, the FAT and the superblock, or give the
+    //    copy's blocks back if that is no longer possible
+    err = full ? 0 : AddPath(disk, fat, &sb, newName, &copy);
+    if (full || err < 0) {
+        for (int j = 0; j < blocks; j++) fat[chain[j]] = 0;
+        if (!full && (copy.flags & DIRENT_TAIL)) TailFree(disk, fat, &sb, &copy);
+    }
+    StoreFAT(disk, fat, &sb);
+    LockRegion(disk, F_UNLCK, 0, 0);
+    if (full || err < 0) {
+        if (full) fprintf(stderr, "Not enough free space\n");
+        else      PathError(err, newName);
+        free(fat); free(srcChain); free(srcHoles); free(chain);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Duplicated '%s' -> '%s' (%u bytes)\n",
+           srcFileName, newName, filesize);
+
+    // cleanup
+    free(fat);
+    free(srcChain);
+    free(srcHoles);
+    free(chain);
+    fclose(disk);
+}
+
+
+void Search(const char *disk_path, const char *srcFileName) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    int found = LookupPath(disk, &sb, srcFileName, NULL, NULL) == 1;
+
+    fclose(disk);
+    printf(found ? "YES\n" : "NO\n");
+}
+
+
+/*   Find   */
+
+/* Sort keys of -find, in order of precedence */
+enum { KEY_NAME, KEY_SIZE, KEY_BLOCK };
+static struct { int key, desc; } findKeys[4];
+static int findKeyCount;
+
+/* Parse --sort such as "size,-name" ('-' = descending) */
+static void ParseSortKeys(const char *text) {
+    char keys[64];
+    snprintf(keys, sizeof(keys), "%s", text);
+    for (char *save, *k = strtok_r(keys, ",", &save); k; k = strtok_r(NULL, ",", &save)) {
+        int desc = *k == '-';
+        if (desc) k++;
+        int key = strcmp(k, "name") == 0  ? KEY_NAME
+                : strcmp(k, "size") == 0  ? KEY_SIZE
+                : strcmp(k, "block") == 0 ? KEY_BLOCK : -1;
+        if (key < 0 || findKeyCount == 4) {
+            fprintf(stderr, "Bad sort key: %s (name, size or block, '-' for descending)\n", k);
+            exit(EXIT_FAILURE);
+        }
+        findKeys[findKeyCount].key  = key;
+        findKeys[findKeyCount].desc = desc;
+        findKeyCount++;
+    }
+}
+
+/* qsort comparison by the --sort keys, then by path */
+static int CompareFind(const void *a, const void *b) {
+    const struct PathEntry *x = *(struct PathEntry *const *)a;
+    const struct PathEntry *y = *(struct PathEntry *const *)b;
+    for (int i = 0; i < findKeyCount; i++) {
+        int c;
+        if (findKeys[i].key == KEY_SIZE) {
+            c = (x->e.size > y->e.size) - (x->e.size < y->e.size);
+        } else if (findKeys[i].key == KEY_BLOCK) {   // files without blocks last
+            uint32_t bx = LINK_BLOCK(x->e.firstBlock), by = LINK_BLOCK(y->e.firstBlock);
+            c = (bx > by) - (bx < by);
+        } else {
+            c = strcmp(x->path, y->path);
+        }
+        if (c) return findKeys[i].desc ? -c : c;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp((*(struct PathEntry *const *)a)->path, (*(struct PathEntry *const *)b)->path);
+}
+
+/* The heap keeps the worst of the best K matches at its top */
+static void SiftDown(struct PathEntry **heap, int n, int i) {
+    while (1) {
+        int worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && CompareFind(&heap[l], &heap[worst]) > 0) worst = l;
+        if (r < n && CompareFind(&heap[r], &heap[worst]) > 0) worst = r;
+        if (worst == i) return;
+        struct PathEntry *t = heap[i]; heap[i] = heap[worst]; heap[worst] = t;
+        i = worst;
+    }
+}
+
+static void SiftUp(struct PathEntry **heap, int i) {
+    while (i > 0 && CompareFind(&heap[i], &heap[(i - 1) / 2]) > 0) {
+        struct PathEntry *t = heap[i]; heap[i] = heap[(i - 1) / 2]; heap[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+static void PrintJsonString(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')   printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+        else                           putchar(*s);
+    }
+    putchar('"');
+}
+
+/* True if a component of the path starts with '.' */
+static int IsHiddenPath(const char *path) {
+    return path[0] == '.' || strstr(path, "/.") != NULL;
+}
+
+/**
+ * Find files by pattern, size range and hidden state. The pattern is a
+ * glob (a prefix is "dir/name*"); without a '/' it is matched against
+ * the file's own name, with one against the whole path. All paths are
+ * read in one pass and sorted into an index, so a pattern starting with
+ * a literal directory part only looks at that range of it. With --limit
+ * and --sort only the best N matches are kept (a heap), instead of
+ * sorting them all.
+ */
+void Find(const char *disk_path, const char *pattern) {
+    if (findSort) ParseSortKeys(findSort);
+
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    int count;
+    struct PathEntry *list = LoadTree(disk, sb.rootDir, &count, NULL);
+    fclose(disk);
+
+    // 1) Index: every path in sorted order
+    struct PathEntry **index = malloc((count ? count : 1) * sizeof(struct PathEntry *));
+    if (!index) { perror("Allocating index"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < count; i++) index[i] = &list[i];
+    qsort(index, count, sizeof(index[0]), compare_path);
+
+    // 2) A path pattern's literal start narrows the range to scan
+    int wholePath = pattern && strchr(pattern, '/') != NULL;
+    int lo = 0;
+    size_t litLen = 0;
+    if (wholePath) {
+        litLen = strcspn(pattern, "*?[\\");
+        int hi = count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (strncmp(index[mid]->path, pattern, litLen) < 0) lo = mid + 1;
+            else                                                hi = mid;
+        }
+    }
+
+    // 3) Match, keeping all matches or only the best findLimit
+    struct PathEntry **found = malloc((count ? count : 1) * sizeof(struct PathEntry *));
+    if (!found) { perror("Allocating index"); exit(EXIT_FAILURE); }
+    int n = 0;
+    for (int i = lo; i < count; i++) {
+        struct PathEntry *pe = index[i];
+        if (litLen && strncmp(pe->path, pattern, litLen) != 0) break;
+        if (pe->e.flags & DIRENT_DIR) continue;
+        if (pe->e.size < findMin || pe->e.size > findMax) continue;
+        int hidden = IsHiddenPath(pe->path);
+        if ((findHidden == 0 && hidden) || (findHidden == 1 && !hidden)) continue;
+        if (pattern) {
+            const char *base = strrchr(pe->path, '/');
+            const char *subject = wholePath ? pe->path : (base ? base + 1 : pe->path);
+            if (fnmatch(pattern, subject, wholePath ? FNM_PATHNAME : 0) != 0) continue;
+        }
+
+        if (findLimit <= 0 || n < findLimit) {
+            found[n++] = pe;
+            if (findLimit > 0 && findKeyCount) SiftUp(found, n - 1);
+            else if (findLimit > 0 && n == findLimit) break;   // path order: the first N are the answer
+        } else if (CompareFind(&pe, &found[0]) < 0) {
+            found[0] = pe;
+            SiftDown(found, n, 0);
+        }
+    }
+    if (findKeyCount) qsort(found, n, sizeof(found[0]), CompareFind);
+
+    // 4) Print
+    if (findJson) printf("[");
+    for (int i = 0; i < n; i++) {
+        const struct DirEntry *e = &found[i]->e;
+        uint32_t block = LINK_BLOCK(e->firstBlock);
+        if (findJson) {
+            printf("%s\n  {\"path\": ", i ? "," : "");
+            PrintJsonString(found[i]->path);
+            printf(", \"size\": %u, \"firstBlock\": ", e->size);
+            if (e->firstBlock == FAT_EOC) printf("null");
+            else                          printf("%u", block);
+            printf(", \"hidden\": %s}", IsHiddenPath(found[i]->path) ? "true" : "false");
+        } else if (e->firstBlock == FAT_EOC) {
+            printf("%s\t%u bytes\n", found[i]->path, e->size);
+        } else {
+            printf("%s\t%u bytes\tblock %u\n", found[i]->path, e->size, block);
+        }
+    }
+    if (findJson) printf("%s]\n", n ? "\n" : "");
+
+    free(found);
+    free(index);
+    FreeTree(list, count);
+}
+
+
+/*
+ * Move the entry at oldPath to newPath (same directory) under the metadata
+ * lock. Returns 0, or AddPath's error with nothing changed.
+ */
+static int RenameEntry(FILE *disk, struct Superblock *sb, const char *oldPath, const char *newPath) {
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+
+    struct DirEntry entry;
+    LookupPath(disk, sb, oldPath, NULL, &entry);
+    int err = AddPath(disk, fat, sb, newPath, &entry);
+    if (err == 0) {
+        RemovePath(disk, fat, sb, oldPath, NULL);
+        StoreFAT(disk, fat, sb);
+    }
+    free(fat);
+    return err;
+}
+
+void Hide(const char *disk_path, const char *srcFileName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+
+    // 1) Find the entry for srcFileName
+    char dirPath[PATH_LEN], name[NAME_LEN];
+    if (SplitPath(srcFileName, dirPath, name) < 0 || LookupPath(disk, &sb, srcFileName, NULL, NULL) != 1) {
+        fprintf(stderr, "File not found: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 2) Build hidden name: prefix '.' (truncated to fit a name)
+    char hidden[PATH_LEN + NAME_LEN + 1];
+    snprintf(hidden, sizeof(hidden), "%s%s.%.*s", dirPath, dirPath[0] ? "/" : "", NAME_LEN - 2, name);
+    int err = CheckPath(disk, &sb, hidden);
+    if (err < 0) {
+        PathError(err, hidden);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 3) Relink the entry under it
+    err = RenameEntry(disk, &sb, srcFileName, hidden);
+    if (err < 0) {
+        PathError(err, hidden);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Hidden '%s'\n", srcFileName);
+    fclose(disk);
+}
+
+
+void Unhide(const char *disk_path, const char *srcFileName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+
+    // 1) Find the entry named ".name" in the same directory
+    char dirPath[PATH_LEN], name[NAME_LEN], hidden[PATH_LEN + NAME_LEN + 1];
+    int ok = SplitPath(srcFileName, dirPath, name) == 0;
+    snprintf(hidden, sizeof(hidden), "%s%s.%s", dirPath, dirPath[0] ? "/" : "", name);
+    if (!ok || LookupPath(disk, &sb, hidden, NULL, NULL) != 1) {
+        fprintf(stderr, "Hidden file not found: %s\n", srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    int err = CheckPath(disk, &sb, srcFileName);
+    if (err < 0) {
+        PathError(err, srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 2) Relink it under the plain name
+    err = RenameEntry(disk, &sb, hidden, srcFileName);
+    if (err < 0) {
+        PathError(err, srcFileName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Unhidden '%s'\n", srcFileName);
+    fclose(disk);
+}
+
+
+/*   Directories: create and remove   */
+
+void MakeDir(const char *disk_path, const char *dirPath) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+
+    // A new directory has no tree yet
+    struct DirEntry entry = { .flags = DIRENT_DIR, .firstBlock = 0, .size = 0 };
+    int err = AddPath(disk, fat, &sb, dirPath, &entry);
+    if (err < 0) {
+        PathError(err, dirPath);
+        free(fat); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    StoreFAT(disk, fat, &sb);
+
+    printf("Created directory '%s'\n", dirPath);
+    free(fat);
+    fclose(disk);
+}
+
+void RemoveDir(const char *disk_path, const char *dirPath) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirEntry entry;
+    if (LookupPath(disk, &sb, dirPath, NULL, &entry) != 1 || !(entry.flags & DIRENT_DIR)) {
+        fprintf(stderr, "Directory not found: %s\n", dirPath);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    if (entry.firstBlock != 0) {
+        fprintf(stderr, "Directory not empty: %s\n", dirPath);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    RemovePath(disk, fat, &sb, dirPath, NULL);
+    StoreFAT(disk, fat, &sb);
+
+    printf("Removed directory '%s'\n", dirPath);
+    free(fat);
+    fclose(disk);
+}
+
+
+/**
+ * Walks every directory and writes all entries to "filelist.txt" in the format:
+ *   idx path firstBlock fileSize [inline | tail block+offset]
+ * where idx is a running number (three digits at least), directories end in
+ * '/' and show the root node of their tree as firstBlock.
+ */
+void PrintFileList(const char *disk_path) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    // Open the output text file
+    FILE *out = fopen("filelist.txt", "w");
+    if (!out) {
+        perror("Error creating filelist.txt");
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    int count, nodes = 0;
+    struct PathEntry *list = LoadTree(disk, sb.rootDir, &count, &nodes);
+
+    for (int i = 0; i < count; i++) {
+        // Write a line: "000 docs/FileA 1 2000"
+        fprintf(out, "%03d %s%s %u %u", i, list[i].path,
+                (list[i].e.flags & DIRENT_DIR) ? "/" : "", list[i].e.firstBlock, list[i].e.size);
+        if (list[i].e.flags & DIRENT_INLINE)    fprintf(out, " inline");
+        else if (list[i].e.flags & DIRENT_TAIL) fprintf(out, " tail %u+%u", list[i].e.tailBlock, list[i].e.tailOff);
+        fputc('\n', out);
+    }
+
+    FreeTree(list, count);
+    fclose(out);
+    fclose(disk);
+
+    printf("File list written to filelist.txt (%d entries, %d directory blocks)\n", count, nodes);
+}
+
+
+void PrintFAT(const char *disk_path) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    FILE *out = fopen("fat.txt", "w");
+    if (!out) {
+        perror("Error creating fat.txt");
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    const int ENTRIES_PER_ROW = 4;
+    uint32_t entry;
+    for (int i = 0; i < FAT_ENTRIES; i++) {
+        // read next FAT entry
+        if (fread(&entry, sizeof(entry), 1, disk) != 1) {
+            perror("Error reading FAT entry");
             fclose(disk);
+            fclose(out);
+            exit(EXIT_FAILURE);
+        }
+
+        
+        fprintf(out, "%04d\t%08X", i, entry);
+
+        // separator or newline every ENTRIES_PER_ROW
+        if ((i + 1) % ENTRIES_PER_ROW == 0) {
+            fputc('\n', out);
+        } else {
+            fputc('\t', out);
+        }
+    }
+
+    fclose(out);
+    fclose(disk);
+    printf("FAT written to fat.txt\n");
+}
+
+
+/**
+ * Print space usage from the superblock counters alone: no FAT or
+ * directory scan, so it costs the same on any image.
+ */
+void DiskFree(const char *disk_path) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    fclose(disk);
+
+    if (!sb.counted) {
+        fprintf(stderr, "Space counters not initialised: run -check first\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t total = FAT_ENTRIES - 1;   // block 0 is the superblock
+    uint32_t held  = total - sb.freeBlocks - sb.usedBlocks;
+    printf("Blocks:   %u of %u bytes\n", total, BLOCK_SIZE);
+    printf("Used:     %u\n", sb.usedBlocks);
+    printf("Snapshot: %u\n", held);
+    printf("Free:     %u (%u%%), largest run %u\n",
+           sb.freeBlocks, (uint32_t)((uint64_t)sb.freeBlocks * 100 / total), sb.largestFree);
+    printf("Files:    %u in %u directories\n", sb.fileCount, sb.dirCount);
+}
+
+
+/**
+ * Print what is known about one entry. For a file: size, data blocks,
+ * holes and where a packed end lives; for a directory: entries and nodes.
+ */
+void Stat(const char *disk_path, const char *name) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirEntry e;
+    if (LookupPath(disk, &sb, name, NULL, &e) != 1) {
+        fprintf(stderr, "File not found: %s\n", name);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Name:   %s\n", name);
+    if (e.flags & DIRENT_DIR) {
+        int n, nodes = 0;
+        struct DirEntry *entries = LoadDir(disk, e.firstBlock, &n, &nodes);
+        free(entries);
+        printf("Type:   directory\n");
+        printf("Entries: %d in %d nodes (root %u)\n", n, nodes, e.firstBlock);
+        fclose(disk);
+        return;
+    }
+
+    uint32_t *fat   = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *chain = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *holes = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat || !chain || !holes) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    fclose(disk);
+
+    int blocks = LoadChain(fat, e.firstBlock, chain, holes);
+    uint32_t fileBlocks = (e.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t packed = (e.flags & (DIRENT_INLINE | DIRENT_TAIL)) ? 1 : 0;
+    printf("Type:   file\n");
+    printf("Size:   %u bytes (%u blocks)\n", e.size, fileBlocks);
+    printf("Data:   %d blocks, %u holes", blocks, fileBlocks - blocks - packed);
+    if (blocks > 0) printf(", first block %u", chain[0]);
+    putchar('\n');
+    if (e.flags & DIRENT_INLINE)    printf("Packed: inline\n");
+    else if (e.flags & DIRENT_TAIL) printf("Packed: %u bytes in tail block %u+%u\n",
+                                           e.size % BLOCK_SIZE, e.tailBlock, e.tailOff);
+
+    free(fat);
+    free(chain);
+    free(holes);
+}
+
+
+/**
+ * Recount the superblock counters from the FAT and the directory tree,
+ * report the ones that were off, and mark them valid. Images formatted
+ * before the counters existed need this once before -df.
+ */
+void Check(const char *disk_path) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct Superblock old = sb;
+
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); fclose(disk); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+
+    int count;
+    struct PathEntry *list = LoadTree(disk, sb.rootDir, &count, NULL);
+    sb.fileCount = sb.dirCount = 0;
+    for (int i = 0; i < count; i++) {
+        if (list[i].e.flags & DIRENT_DIR) sb.dirCount++;
+        else                              sb.fileCount++;
+    }
+    FreeTree(list, count);
+    CountBlocks(fat, &sb);
+
+    int fixed = 0;
+    if (old.counted) {
+        const char *names[] = { "free blocks", "used blocks", "largest free run", "files", "directories" };
+        const uint32_t was[] = { old.freeBlocks, old.usedBlocks, old.largestFree, old.fileCount, old.dirCount };
+        const uint32_t now[] = { sb.freeBlocks, sb.usedBlocks, sb.largestFree, sb.fileCount, sb.dirCount };
+        for (int i = 0; i < 5; i++) {
+            if (was[i] == now[i]) continue;
+            printf("Fixed %s: %u -> %u\n", names[i], was[i], now[i]);
+            fixed++;
+        }
+    }
+    sb.counted = 1;
+    StoreSuperblock(disk, &sb);
+
+    if (!old.counted) printf("Space counters initialised\n");
+    else              printf("Space counters checked: %d fixed\n", fixed);
+    free(fat);
+    fclose(disk);
+}
+
+
+/*
+ * Rebuild the directory whose entries start at list[*pos] (parents before
+ * children, as LoadTree returns them) with packed nodes, its
+ * subdirectories first. Returns its new root, or FAT_EOC as BuildDir does.
+ */
+static uint32_t RebuildDir(FILE *disk, uint32_t *fat, struct PathEntry *list, int count, int *pos, int depth) {
+    struct DirEntry *entries = malloc((count ? count : 1) * sizeof(struct DirEntry));
+    if (!entries) { perror("Allocating directory"); exit(EXIT_FAILURE); }
+    int n = 0;
+    while (*pos < count && list[*pos].depth == depth) {
+        struct DirEntry e = list[(*pos)++].e;
+        if (e.flags & DIRENT_DIR) {
+            e.firstBlock = RebuildDir(disk, fat, list, count, pos, depth + 1);
+            if (e.firstBlock == FAT_EOC) { free(entries); return FAT_EOC; }
+        }
+        entries[n++] = e;
+    }
+    uint32_t root = BuildDir(disk, fat, entries, n);
+    free(entries);
+    return root;
+}
+
+void Defragment(const char *disk_path) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    // Blocks move around: wait until every writer has finished its data phase
+    LockRegion(disk, F_WRLCK, 0, 0);
+
+    // 1) Load current FAT
+    uint32_t *oldFAT = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!oldFAT) { perror("Allocating oldFAT"); fclose(disk); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(oldFAT, sizeof(uint32_t), FAT_ENTRIES, disk);
+
+    // 2) Walk every directory and read every file's blocks into memory.
+    //    Blocks no entry reaches (writes interrupted before their commit)
+    //    are simply left out of the new FAT.
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    int count, nodes = 0;
+    struct PathEntry *list = LoadTree(disk, sb.rootDir, &count, &nodes);
+
+    typedef struct {
+        uint32_t blocks;  // number of data blocks
+        uint32_t *holes;  // hole blocks in front of each data block
+        char    *data;    // all block data concatenated
+        char    *tail;    // packed tail (DIRENT_TAIL)
+    } DefragEntry;
+
+    DefragEntry *files = calloc(count ? count : 1, sizeof(DefragEntry));
+    if (!files) { perror("Allocating files array"); free(oldFAT); fclose(disk); exit(EXIT_FAILURE); }
+
+    for (int i = 0; i < count; i++) {
+        if (list[i].e.flags & DIRENT_DIR) continue;
+
+        // build chain of old block indices (holes have none)
+        uint32_t *chain = malloc(FAT_ENTRIES * sizeof(uint32_t));
+        uint32_t *holes = malloc(FAT_ENTRIES * sizeof(uint32_t));
+        if (!chain || !holes) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+        uint32_t blocks = LoadChain(oldFAT, list[i].e.firstBlock, chain, holes);
+
+        // read all data blocks into one buffer (Write zero-pads the last one)
+        char *data  = malloc((blocks ? blocks : 1) * BLOCK_SIZE);
+        char **bufs = malloc((blocks ? blocks : 1) * sizeof(char *));
+        if (!data || !bufs) { perror("Allocating data buffer"); exit(EXIT_FAILURE); }
+        for (uint32_t b = 0; b < blocks; b++) bufs[b] = data + b*BLOCK_SIZE;
+        if (blocks > 0) TransferBlocks(disk, chain, blocks, bufs, 0);
+        free(bufs);
+        free(chain);
+
+        if (list[i].e.flags & DIRENT_TAIL) {
+            files[i].tail = malloc(BLOCK_SIZE);
+            if (!files[i].tail) { perror("Allocating data buffer"); exit(EXIT_FAILURE); }
+            TailRead(disk, &list[i].e, files[i].tail);
+        }
+
+        files[i].blocks = blocks;
+        files[i].holes  = holes;
+        files[i].data   = data;
+    }
+    // 3) Build a fresh FAT
+    uint32_t *newFAT = calloc(FAT_ENTRIES, sizeof(uint32_t));
+    if (!newFAT) { perror("Allocating newFAT"); exit(EXIT_FAILURE); }
+    newFAT[0] = FAT_EOC;  // reserved
+
+    // 3a) Snapshots are never moved: keep their own chains, and keep every
+    //     block they reference out of the blocks we are about to rewrite
+    uint8_t pinned[FAT_ENTRIES];
+    LoadPinned(disk, oldFAT, &sb, pinned);
+    for (uint32_t s = 0; s < sb.snapCount; s++) {
+        for (uint32_t cur = sb.snaps[s].metaBlock; ; cur = oldFAT[cur]) {
+            newFAT[cur] = oldFAT[cur];
+            if (oldFAT[cur] == FAT_EOC) break;
+        }
+    }
+    ApplyPinned(newFAT, pinned);
+    free(oldFAT);
+
+    // 3b) Files sharing blocks with a snapshot get fresh copies, so make
+    //     sure they (and the directories, which never need more nodes once
+    //     packed) fit before anything is overwritten
+    uint32_t needed = nodes, available = 0, tailUnits = 0;
+    for (int f = 0; f < count; f++) {
+        needed    += files[f].blocks;
+        tailUnits += (TailBytes(&list[f].e) + TAIL_UNIT - 1) / TAIL_UNIT;
+    }
+    // tails are at most half a block, so every filled tail block holds
+    // at least 16 units
+    if (tailUnits > 0) needed += tailUnits / 16 + 1;
+    for (int b = 1; b < FAT_ENTRIES; b++) if (newFAT[b] == 0) available++;
+    if (needed > available) {
+        fprintf(stderr, "Not enough free space to defragment around snapshots\n");
+        for (int f = 0; f < count; f++) { free(files[f].data); free(files[f].holes); free(files[f].tail); }
+        free(files); free(newFAT); FreeTree(list, count); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 4) Write each file back contiguously, stepping over snapshot blocks
+    uint32_t nextFree = 1;
+
+    for (int f = 0; f < count; f++) {
+        if (list[f].e.flags & DIRENT_DIR) continue;
+        uint32_t blocks = files[f].blocks;
+        char *data      = files[f].data;
+        uint32_t firstNew = FAT_EOC, prev = 0;
+        uint32_t *dest = malloc((blocks ? blocks : 1) * sizeof(uint32_t));
+        char **bufs    = malloc((blocks ? blocks : 1) * sizeof(char *));
+        if (!dest || !bufs) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+
+        for (uint32_t b = 0; b < blocks; b++) {
+            while (newFAT[nextFree] != 0) nextFree++;
+            uint32_t newBlk = nextFree++;
+            dest[b] = newBlk;
+            bufs[b] = data + b*BLOCK_SIZE;
+            // update FAT chain
+            uint32_t link = MAKE_LINK(newBlk, files[f].holes[b]);
+            if (b == 0) firstNew = link;
+            else        newFAT[prev] = link;
+            newFAT[newBlk] = FAT_EOC;
+            prev = newBlk;
+        }
+        // write the file's blocks (one transfer per run, members in parallel)
+        if (blocks > 0) TransferBlocks(disk, dest, blocks, bufs, 1);
+        free(dest);
+        free(bufs);
+        // all holes: first block stays FAT_EOC
+        list[f].e.firstBlock = firstNew;
+    }
+
+    // 4a) Tails are packed afresh right behind them ...
+    sb.tailBlock = 0;
+    for (int f = 0; f < count; f++) {
+        if (!files[f].tail) continue;
+        list[f].e.flags &= ~DIRENT_TAIL;
+        TailAlloc(disk, newFAT, &sb, files[f].tail, &list[f].e);
+    }
+
+    // 4b) ... and directories right behind those, each packed into as few
+    //     nodes as its entries need
+    int pos = 0;
+    sb.rootDir = RebuildDir(disk, newFAT, list, count, &pos, 0);
+    if (sb.rootDir == FAT_EOC) {
+        // cannot happen after the check in 3b: packing never needs more nodes
+        fprintf(stderr, "Not enough free space for the directories\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 5) Write the new FAT and the superblock over the old ones
+    StoreFAT(disk, newFAT, &sb);
+
+    // --- after writing newFAT to disk, release all freed blocks ---
+    uint32_t *freed = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!freed) { perror("Allocating free list"); exit(EXIT_FAILURE); }
+    int freedCount = 0;
+    for (uint32_t b = nextFree; b < FAT_ENTRIES; b++) {
+        if (newFAT[b] != 0) continue;   // snapshot data and directories stay intact
+        freed[freedCount++] = b;
+    }
+    ReleaseBlockList(disk, freed, freedCount);
+    free(freed);
+
+    // 6) Cleanup
+    for (int f = 0; f < count; f++) { free(files[f].data); free(files[f].holes); free(files[f].tail); }
+    free(files);
+    FreeTree(list, count);
+    free(newFAT);
+    fclose(disk);
+
+    printf("Disk defragmented successfully.\n");
+}
+
+
+/*   Snapshots      */
+
+/* Find a snapshot by name in the superblock table, or -1 */
+static int FindSnapshot(const struct Superblock *sb, const char *snapName) {
+    for (uint32_t s = 0; s < sb->snapCount; s++) {
+        if (strcmp(sb->snaps[s].name, snapName) == 0) return (int)s;
+    }
+    return -1;
+}
+
+/* Every path on the image as snapshot records (see LoadSnapshot) */
+static char *SerializeTree(const struct PathEntry *list, int count, size_t *len) {
+    size_t bytes = 4;
+    for (int i = 0; i < count; i++) bytes += 12 + strlen(list[i].path) + ExtraBytes(&list[i].e);
+    char *buf = calloc(1, bytes);
+    if (!buf) { perror("Allocating snapshot buffer"); exit(EXIT_FAILURE); }
+
+    uint32_t n = count;
+    memcpy(buf, &n, sizeof(n));
+    char *p = buf + 4;
+    for (int i = 0; i < count; i++) {
+        uint16_t pathLen = strlen(list[i].path);
+        p[0] = list[i].e.flags;
+        memcpy(p + 2, &pathLen, sizeof(pathLen));
+        memcpy(p + 4, &list[i].e.firstBlock, sizeof(uint32_t));
+        memcpy(p + 8, &list[i].e.size, sizeof(uint32_t));
+        memcpy(p + 12, list[i].path, pathLen);
+        p += 12 + pathLen;
+        if (list[i].e.flags & DIRENT_TAIL) {
+            memcpy(p, &list[i].e.tailBlock, sizeof(uint32_t));
+            memcpy(p + 4, &list[i].e.tailOff, sizeof(uint16_t));
+        } else if (list[i].e.flags & DIRENT_INLINE) {
+            memcpy(p, list[i].e.data, list[i].e.size);
+        }
+        p += ExtraBytes(&list[i].e);
+    }
+    *len = bytes;
+    return buf;
+}
+
+/**
+ * Freeze the current FAT and directory tree as a named snapshot.
+ * Only the metadata is copied (the FAT plus one record per path); file
+ * data stays shared with the live image, and Delete/Defragment leave any
+ * block a snapshot still references untouched.
+ */
+void Snapshot(const char *disk_path, const char *snapName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, 0);
+
+    if (snapName[0] == '\0' || strlen(snapName) >= SNAP_NAME_LEN) {
+        fprintf(stderr, "Snapshot name must be 1-%d characters\n", SNAP_NAME_LEN - 1);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    if (FindSnapshot(&sb, snapName) >= 0) {
+        fprintf(stderr, "A snapshot named '%s' already exists\n", snapName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    if (sb.snapCount >= MAX_SNAPSHOTS) {
+        fprintf(stderr, "Snapshot table is full (%d snapshots)\n", MAX_SNAPSHOTS);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 1) Build the snapshot as it is now: FAT followed by every path
+    int count;
+    struct PathEntry *list = LoadTree(disk, sb.rootDir, &count, NULL);
+    size_t recLen;
+    char *records = SerializeTree(list, count, &recLen);
+    FreeTree(list, count);
+
+    size_t fatLen = FAT_ENTRIES * sizeof(uint32_t);
+    int metaBlocks = (fatLen + recLen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char *meta = calloc(metaBlocks, BLOCK_SIZE);
+    if (!meta) { perror("Allocating snapshot buffer"); fclose(disk); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(meta, 1, fatLen, disk);
+    memcpy(meta + fatLen, records, recLen);
+    free(records);
+
+    uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    memcpy(fat, meta, fatLen);
+
+    // 2) Find free blocks for the frozen metadata
+    int *chain = malloc(metaBlocks * sizeof(int));
+    if (!chain) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    int found = 0;
+    for (int i = 1; i < FAT_ENTRIES && found < metaBlocks; i++) {
+        if (fat[i] == 0) chain[found++] = i;
+    }
+    if (found < metaBlocks) {
+        fprintf(stderr, "Not enough free space\n");
+        free(meta); free(fat); free(chain); fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 3) Copy the metadata into them
+    for (int b = 0; b < metaBlocks; b++) {
+        fseek(disk, DATA_OFFSET + (off_t)chain[b] * BLOCK_SIZE, SEEK_SET);
+        fwrite(meta + (size_t)b * BLOCK_SIZE, 1, BLOCK_SIZE, disk);
+    }
+
+    // 4) Link the chain in the live FAT and record the snapshot
+    for (int b = 0; b < metaBlocks - 1; b++) fat[chain[b]] = chain[b+1];
+    fat[chain[metaBlocks - 1]] = FAT_EOC;
+
+    struct Snapshot *snap = &sb.snaps[sb.snapCount++];
+    memset(snap, 0, sizeof(*snap));
+    strncpy(snap->name, snapName, SNAP_NAME_LEN - 1);
+    snap->metaBlock = chain[0];
+    snap->created   = (uint32_t)time(NULL);
+    sb.tailBlock    = 0;   // units freed from now on may still hold frozen tails
+
+    // 5) Everything live is now pinned as well
+    uint8_t pinned[FAT_ENTRIES];
+    ScanPinned(disk, fat, &sb, pinned);
+    StorePinned(disk, fat, &sb, pinned);
+    StoreFAT(disk, fat, &sb);
+
+    printf("Snapshot '%s' created (%d metadata blocks)\n", snapName, metaBlocks);
+
+    free(meta);
+    free(fat);
+    free(chain);
+    fclose(disk);
+}
+
+
+/**
+ * Restore the FAT and directory tree frozen in a snapshot. The snapshot
+ * itself (and every other one) is kept; blocks only the discarded state
+ * used become free again.
+ */
+void Rollback(const char *disk_path, const char *snapName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, 0);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    int idx = FindSnapshot(&sb, snapName);
+    if (idx < 0) {
+        fprintf(stderr, "Snapshot not found: %s\n", snapName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // 1) Load live FAT and the snapshot's frozen metadata
+    uint32_t *fat     = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *snapFat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *newFAT  = calloc(FAT_ENTRIES, sizeof(uint32_t));
+    if (!fat || !snapFat || !newFAT) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    int count;
+    struct PathEntry *list = LoadSnapshot(disk, fat, sb.snaps[idx].metaBlock, snapFat, &count);
+
+    // 2) New FAT = the snapshot's file chains and tail blocks ...
+    newFAT[0] = FAT_EOC;  // reserved
+    for (int i = 0; i < count; i++) {
+        uint32_t firstBlock = list[i].e.firstBlock;
+        if (list[i].e.flags & DIRENT_TAIL) newFAT[list[i].e.tailBlock] = FAT_EOC;
+        if ((list[i].e.flags & DIRENT_DIR) || firstBlock == FAT_EOC) continue;
+        for (uint32_t cur = LINK_BLOCK(firstBlock); ; cur = LINK_BLOCK(snapFat[cur])) {
+            newFAT[cur] = snapFat[cur];
+            if (snapFat[cur] == FAT_EOC) break;
+        }
+    }
+
+    // 2a) ... plus the blocks holding every snapshot ...
+    for (uint32_t s = 0; s < sb.snapCount; s++) {
+        for (uint32_t cur = sb.snaps[s].metaBlock; ; cur = fat[cur]) {
+            newFAT[cur] = fat[cur];
+            if (fat[cur] == FAT_EOC) break;
+        }
+    }
+
+    // 2b) ... with everything else a snapshot references kept reserved
+    uint8_t pinned[FAT_ENTRIES];
+    LoadPinned(disk, fat, &sb, pinned);
+    ApplyPinned(newFAT, pinned);
+
+    // 2c) Tail blocks were shared with the discarded state: their bitmaps
+    //     become exactly the restored tails
+    uint8_t done[FAT_ENTRIES] = {0};
+    for (int i = 0; i < count; i++) {
+        if (!(list[i].e.flags & DIRENT_TAIL) || done[list[i].e.tailBlock]) continue;
+        uint32_t blk = list[i].e.tailBlock, bitmap = 1, magic = TAIL_MAGIC;
+        for (int j = i; j < count; j++) {
+            if ((list[j].e.flags & DIRENT_TAIL) && list[j].e.tailBlock == blk)
+                bitmap |= TailMask(list[j].e.tailOff, TailBytes(&list[j].e));
+        }
+        fseek(disk, DATA_OFFSET + (off_t)blk * BLOCK_SIZE, SEEK_SET);
+        fwrite(&magic, sizeof(magic), 1, disk);
+        fwrite(&bitmap, sizeof(bitmap), 1, disk);
+        done[blk] = 1;
+    }
+
+    // 3) Rebuild the directories from the frozen paths (parents come
+    //    first), with nodes taken from the restored free space
+    sb.rootDir   = 0;
+    sb.tailBlock = 0;
+    sb.fileCount = sb.dirCount = 0;   // counted again as the paths are added
+    for (int i = 0; i < count; i++) {
+        struct DirEntry e = list[i].e;
+        if (e.flags & DIRENT_DIR) e.firstBlock = 0;   // filled as its entries arrive
+        int err = AddPath(disk, newFAT, &sb, list[i].path, &e);
+        if (err < 0) {
+            PathError(err, list[i].path);
             exit(EXIT_FAILURE);
         }
     }
 
-    // 3) Compute how many blocks
-    int blocks = (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // 4) Write the restored FAT and the superblock
+    StoreFAT(disk, newFAT, &sb);
+
+    printf("Rolled back to snapshot '%s'\n", snapName);
+
+    FreeTree(list, count);
+    free(fat);
+    free(snapFat);
+    free(newFAT);
+    fclose(disk);
+}
+
+
+/* List snapshots: name, creation time and number of files */
+void ListSnapshots(const char *disk_path) {
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    if (sb.snapCount == 0) {
+        printf("No snapshots\n");
+        fclose(disk);
+        return;
+    }
+
+    uint32_t *fat     = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *snapFat = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat || !snapFat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+
+    for (uint32_t s = 0; s < sb.snapCount; s++) {
+        int count;
+        struct PathEntry *list = LoadSnapshot(disk, fat, sb.snaps[s].metaBlock, snapFat, &count);
+        int files = 0;
+        for (int i = 0; i < count; i++) {
+            if (!(list[i].e.flags & DIRENT_DIR)) files++;
+        }
+        FreeTree(list, count);
+
+        char when[32];
+        time_t created = (time_t)sb.snaps[s].created;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+        printf("%s\t%s\t%d files\n", sb.snaps[s].name, when, files);
+    }
+
+    free(fat);
+    free(snapFat);
+    fclose(disk);
+}
+
+
+/* Drop a snapshot and release the blocks only it was holding */
+void DropSnapshot(const char *disk_path, const char *snapName) {
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_WRLCK, 0, 0);
+
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    int idx = FindSnapshot(&sb, snapName);
+    if (idx < 0) {
+        fprintf(stderr, "Snapshot not found: %s\n", snapName);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
 
-    // 4) Load FAT
     uint32_t *fat = malloc(FAT_ENTRIES * sizeof(uint32_t));
     if (!fat) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
     fseek(disk, 0, SEEK_SET);
     fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
 
-    // 4a) Copy original FAT for reading source chain
-    uint32_t *origFat = malloc(FAT_ENTRIES * sizeof(uint32_t));
-    memcpy(origFat, fat, FAT_ENTRIES * sizeof(uint32_t));
+    // 1) Free the snapshot's metadata chain
+    uint32_t cur = sb.snaps[idx].metaBlock;
+    while (cur != FAT_EOC) {
+        uint32_t next = fat[cur];
+        fat[cur] = 0;
+        cur = next;
+    }
 
-    // 5) Find free blocks
-    int *chain = malloc(blocks * sizeof(int));
-    int found = 0;
-    for (int i = 1; i < FAT_ENTRIES && found < blocks; i++) {
-        if (fat[i] == 0) chain[found++] = i;
+    // 2) Remove it from the table
+    memmove(&sb.snaps[idx], &sb.snaps[idx + 1],
+            (sb.snapCount - idx - 1) * sizeof(struct Snapshot));
+    sb.snapCount--;
+    memset(&sb.snaps[sb.snapCount], 0, sizeof(struct Snapshot));
+
+    // 3) Blocks no remaining snapshot references become free
+    uint8_t pinned[FAT_ENTRIES];
+    ScanPinned(disk, fat, &sb, pinned);
+    StorePinned(disk, fat, &sb, pinned);
+    ApplyPinned(fat, pinned);
+
+    StoreFAT(disk, fat, &sb);
+
+    printf("Dropped snapshot '%s'\n", snapName);
+
+    free(fat);
+    fclose(disk);
+}
+
+
+/*   Delayed allocation   */
+
+/*
+ * Writes and appends issued through -batch (and -append) are buffered per
+ * file in memory and only placed on the image when flushed: once the
+ * buffered bytes reach --buffer-limit, when the oldest buffered data is
+ * --flush-interval seconds old, on -sync, and before any other command runs.
+ * At flush time all buffered files are laid out back to back in one free
+ * run when possible, and their dirty blocks are written sorted by block
+ * number so that neighbours go out as a single large write.
+ */
+struct PendingFile {
+    char    name[PATH_LEN];
+    int     append;     // add to the end of the file instead of creating one
+    char   *data;
+    size_t  len;
+};
+
+static struct PendingFile *pending;
+static int    pendingCount;
+static size_t pendingBytes;
+static time_t pendingSince;   // when the oldest buffered data arrived
+
+/* What a flush does for one buffered file */
+struct FlushPlan {
+    int          existing;    // appending to a file already on the image
+    struct DirEntry old;      // ... and its entry before the flush
+    int          pack;        // DIRENT_INLINE / DIRENT_TAIL: the end is packed
+    const char  *packed;      // ... this data (not one of the new blocks)
+    uint32_t     firstBlock;  // link stored in the directory entry
+    uint32_t     size;        // file size after the flush
+    uint32_t     lastKept;    // last data block kept from the old chain (0 = none)
+    uint32_t     keptLink;    // its FAT entry before the new blocks were linked
+    uint32_t     dropped;     // old last block being rewritten, freed on commit
+    int64_t      lastIdx;     // its index within the file (-1 = none)
+    char        *tail;        // zero-padded data from the first rewritten block on
+    int          count;       // new data blocks
+    int          cap;
+    uint32_t    *idx;         // file block index of each new data block
+    const char **src;         // its contents (NULL = zero block)
+    uint32_t    *blk;         // image block assigned to it
+};
+
+/* A block waiting to be written: NULL data means a zero block */
+struct DirtyBlock {
+    uint32_t    blk;
+    const char *data;
+};
+
+static int compare_dirty(const void *a, const void *b) {
+    const struct DirtyBlock *da = a;
+    const struct DirtyBlock *db = b;
+    if (da->blk < db->blk) return -1;
+    if (da->blk > db->blk) return  1;
+    return 0;
+}
+
+/* First run of count free blocks, or -1 */
+static int FindFreeRun(const uint32_t *fat, int count) {
+    int run = 0;
+    for (int i = 1; i < FAT_ENTRIES; i++) {
+        run = (fat[i] == 0) ? run + 1 : 0;
+        if (run == count) return i - count + 1;
+    }
+    return -1;
+}
+
+static void PlanBlock(struct FlushPlan *fp, uint32_t idx, const char *src) {
+    if (fp->count == fp->cap) {
+        fp->cap = fp->cap ? fp->cap * 2 : 8;
+        fp->idx = realloc(fp->idx, fp->cap * sizeof(uint32_t));
+        fp->src = realloc(fp->src, fp->cap * sizeof(const char *));
+        if (!fp->idx || !fp->src) { perror("Allocating flush plan"); exit(EXIT_FAILURE); }
+    }
+    fp->idx[fp->count] = idx;
+    fp->src[fp->count] = src;
+    fp->count++;
+}
+
+/* Place every buffered file on the image and write its data */
+static void FlushPending(const char *disk_path) {
+    if (pendingCount == 0) return;
+
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    LockRegion(disk, F_RDLCK, META_END, 0);
+    LockRegion(disk, F_WRLCK, 0, META_END);
+
+    // 1) Load FAT and superblock
+    uint32_t *fat   = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *chain = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *holes = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    struct FlushPlan *plan = calloc(pendingCount, sizeof(struct FlushPlan));
+    if (!fat || !chain || !holes || !plan) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+
+    // 2) Work out which blocks of each file have to be written
+    int hasAppend = 0, total = 0, tails = 0;
+    for (int f = 0; f < pendingCount; f++) {
+        struct PendingFile *pf = &pending[f];
+        struct FlushPlan *fp = &plan[f];
+        uint32_t base = 0, partial = 0;
+        struct DirEntry *old = &fp->old;
+        fp->lastIdx = -1;
+
+        if (pf->append && LookupPath(disk, &sb, pf->name, NULL, old) == 1) {
+            if (old->flags & DIRENT_DIR) {
+                fprintf(stderr, "Is a directory: %s\n", pf->name);
+                exit(EXIT_FAILURE);
+            }
+            fp->existing = 1;
+        }
+
+        if (fp->existing) {
+            // Appending: keep the old chain, rewrite its partial last block
+            uint32_t oldSize = old->size;
+            fp->firstBlock = old->firstBlock;
+            if ((uint64_t)oldSize + pf->len > UINT32_MAX) {
+                fprintf(stderr, "File too large: %s\n", pf->name);
+                exit(EXIT_FAILURE);
+            }
+            fp->size = oldSize + pf->len;
+            hasAppend = 1;
+
+            int n = LoadChain(fat, fp->firstBlock, chain, holes);
+            for (int k = 0; k < n; k++) fp->lastIdx += holes[k] + 1;
+            base    = oldSize / BLOCK_SIZE;
+            partial = oldSize % BLOCK_SIZE;
+
+            fp->tail = calloc(((partial + pf->len) / BLOCK_SIZE + 1) * BLOCK_SIZE, 1);
+            if (!fp->tail) { perror("Allocating flush buffer"); exit(EXIT_FAILURE); }
+            if (old->flags & DIRENT_INLINE) {
+                memcpy(fp->tail, old->data, partial);
+            } else if (old->flags & DIRENT_TAIL) {
+                TailRead(disk, old, fp->tail);  // its units are freed on commit
+            } else if (partial && n > 0 && fp->lastIdx == base) {
+                fseek(disk, DATA_OFFSET + (off_t)chain[n-1] * BLOCK_SIZE, SEEK_SET);
+                fread(fp->tail, 1, partial, disk);
+                fp->dropped = chain[n-1];       // replaced by the rewritten block
+                fp->lastIdx -= holes[n-1] + 1;
+                n--;
+            }
+            fp->lastKept = n > 0 ? chain[n-1] : 0;
+        } else {
+            // New file: its path must be free on the image and in this batch
+            int err = CheckPath(disk, &sb, pf->name);
+            for (int g = 0; g < f && err == 0; g++) {
+                if (strcmp(pending[g].name, pf->name) == 0) err = -3;
+            }
+            if (err < 0) {
+                PathError(err, pf->name);
+                exit(EXIT_FAILURE);
+            }
+            fp->size = pf->len;
+            fp->tail = calloc((pf->len / BLOCK_SIZE + 1) * BLOCK_SIZE, 1);
+            if (!fp->tail) { perror("Allocating flush buffer"); exit(EXIT_FAILURE); }
+        }
+        memcpy(fp->tail + partial, pf->data, pf->len);
+
+        // A small file's last data block is packed instead of getting a
+        // block (inline only if no block of the old chain is kept)
+        uint32_t last = fp->size / BLOCK_SIZE;
+        fp->pack = PackKind(fp->size);
+        if (fp->pack == DIRENT_INLINE && fp->lastKept != 0) fp->pack = 0;
+        if (fp->pack && last >= base) {
+            fp->packed = fp->tail + (size_t)(last - base) * BLOCK_SIZE;
+            if (IsZeroBlock(fp->packed, BLOCK_SIZE)) fp->pack = 0;
+        } else {
+            fp->pack = 0;
+        }
+
+        // Zero blocks become holes; a link skips at most MAX_HOLE_RUN of them
+        uint32_t cnt = (partial + pf->len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int64_t prevIdx = fp->lastIdx;
+        for (uint32_t b = 0; b < cnt; b++) {
+            const char *block = fp->tail + (size_t)b * BLOCK_SIZE;
+            if (IsZeroBlock(block, BLOCK_SIZE) || (fp->pack && block == fp->packed)) continue;
+            int64_t idx = base + b;
+            while (idx - prevIdx - 1 > MAX_HOLE_RUN) {
+                prevIdx += MAX_HOLE_RUN + 1;
+                PlanBlock(fp, (uint32_t)prevIdx, NULL);
+            }
+            PlanBlock(fp, (uint32_t)idx, block);
+            prevIdx = idx;
+        }
+        total += fp->count;
+        if (fp->pack == DIRENT_TAIL) tails = 1;
     }
-    if (found < blocks) {
+
+    // Rewritten last blocks a snapshot still references must stay put
+    uint8_t pinned[FAT_ENTRIES];
+    if (sb.snapCount > 0) {
+        LoadPinned(disk, fat, &sb, pinned);
+        ApplyPinned(fat, pinned);
+    }
+
+    int freeBlocks = 0;
+    for (int i = 1; i < FAT_ENTRIES; i++) if (fat[i] == 0) freeBlocks++;
+    if (freeBlocks < total + tails) {
         fprintf(stderr, "Not enough free space\n");
-        free(fat); free(origFat); free(chain);
-        fclose(disk);
         exit(EXIT_FAILURE);
     }
 
-    // 6) Update FAT chain
-    for (int j = 0; j < blocks - 1; j++)
-        fat[chain[j]] = chain[j+1];
-    fat[chain[blocks-1]] = 0xFFFFFFFF;
+    // 3) Assign blocks only now: all files in one free run if there is one,
+    //    otherwise one run per file, otherwise wherever there is room
+    int run = total > 0 ? FindFreeRun(fat, total) : -1;
+    for (int f = 0; f < pendingCount; f++) {
+        struct FlushPlan *fp = &plan[f];
+        fp->blk = malloc((fp->count ? fp->count : 1) * sizeof(uint32_t));
+        if (!fp->blk) { perror("Allocating flush plan"); exit(EXIT_FAILURE); }
+
+        int next = run >= 0 ? run : (fp->count > 0 ? FindFreeRun(fat, fp->count) : -1);
+        for (int k = 0; k < fp->count; k++) {
+            if (next < 0) {
+                for (int i = 1; i < FAT_ENTRIES; i++) if (fat[i] == 0) { fp->blk[k] = i; break; }
+            } else {
+                fp->blk[k] = next++;
+            }
+            fat[fp->blk[k]] = FAT_EOC;
+        }
+        if (run >= 0) run = next;
+
+        // Link the new blocks behind whatever was kept
+        uint32_t prevBlk = fp->lastKept;
+        int64_t prevIdx = fp->lastIdx;
+        fp->keptLink = prevBlk ? fat[prevBlk] : 0;
+        if (prevBlk == 0) fp->firstBlock = FAT_EOC;
+        for (int k = 0; k < fp->count; k++) {
+            uint32_t link = MAKE_LINK(fp->blk[k], fp->idx[k] - prevIdx - 1);
+            if (prevBlk) fat[prevBlk] = link;
+            else         fp->firstBlock = link;
+            prevBlk = fp->blk[k];
+            prevIdx = fp->idx[k];
+        }
+        if (prevBlk) fat[prevBlk] = FAT_EOC;
+    }
 
-    // 7) Write updated FAT back
-    fseek(disk, 0, SEEK_SET);
-    fwrite(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    // The new chains are ours once they are in the FAT, like in Write.
+    // Appends change a visible chain, so for those the metadata lock is
+    // kept until commit.
+    StoreFAT(disk, fat, &sb);
+    if (!hasAppend) LockRegion(disk, F_UNLCK, 0, META_END);
+
+    // 4) Write the dirty blocks in block order, one write per contiguous run
+    struct DirtyBlock *dirty = malloc((total ? total : 1) * sizeof(struct DirtyBlock));
+    char *staging = malloc((size_t)(total ? total : 1) * BLOCK_SIZE);
+    if (!dirty || !staging) { perror("Allocating write buffer"); exit(EXIT_FAILURE); }
+    int d = 0;
+    for (int f = 0; f < pendingCount; f++) {
+        for (int k = 0; k < plan[f].count; k++) {
+            dirty[d].blk  = plan[f].blk[k];
+            dirty[d].data = plan[f].src[k];
+            d++;
+        }
+    }
+    qsort(dirty, total, sizeof(dirty[0]), compare_dirty);
+
+    int writes = 0;
+    for (int i = 0; i < total; ) {
+        int j = i;
+        while (j + 1 < total && dirty[j+1].blk == dirty[j].blk + 1) j++;
+        for (int k = i; k <= j; k++) {
+            char *dst = staging + (size_t)(k - i) * BLOCK_SIZE;
+            if (dirty[k].data) memcpy(dst, dirty[k].data, BLOCK_SIZE);
+            else               memset(dst, 0, BLOCK_SIZE);
+        }
+        fseek(disk, DATA_OFFSET + (off_t)dirty[i].blk * BLOCK_SIZE, SEEK_SET);
+        fwrite(staging, BLOCK_SIZE, j - i + 1, disk);
+        writes++;
+        i = j + 1;
+    }
 
-    // 8) Copy data blocks
-    off_t data_start = FAT_ENTRIES * sizeof(uint32_t)
-                     + FILE_ENTRIES * 256;
-    char buffer[BLOCK_SIZE];
-    uint32_t cur = firstBlock;
-    for (int j = 0; j < blocks; j++) {
-        // read source block
-        fseek(disk, data_start + cur * BLOCK_SIZE, SEEK_SET);
-        fread(buffer, 1, BLOCK_SIZE, disk);
-        // write to new block
-        fseek(disk, data_start + chain[j] * BLOCK_SIZE, SEEK_SET);
-        fwrite(buffer, 1, BLOCK_SIZE, disk);
-        cur = origFat[cur];
-    }
-
-    // 9) Find free directory slot
-    int slotDst = -1;
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        uint32_t fb = 0;
-        fseek(disk, filelist_offset + i*256 + 248, SEEK_SET);
-        fread(&fb, sizeof(fb), 1, disk);
-        if (fb == 0) { slotDst = i; break; }
-    }
-    if (slotDst < 0) {
-        fprintf(stderr, "No free file-list entries\n");
-        free(fat); free(origFat); free(chain);
-        fclose(disk);
-        exit(EXIT_FAILURE);
-    }
-
-    // 10) Write new file-list entry
-    long entryPos = filelist_offset + slotDst * 256;
-    fseek(disk, entryPos, SEEK_SET);
-    char namebuf[248] = {0};
-    strncpy(namebuf, newName, sizeof(namebuf)-1);
-    fwrite(namebuf, 1, 248, disk);
-    uint32_t fb0 = chain[0];
-    fwrite(&fb0, sizeof(fb0), 1, disk);
-    fwrite(&filesize, sizeof(filesize), 1, disk);
+    // 5) Commit the directory entries: without the lock the tree may have
+    //    changed meanwhile
+    if (!hasAppend) {
+        LockRegion(disk, F_WRLCK, 0, META_END);
+        fseek(disk, 0, SEEK_SET);
+        fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+        LoadSuperblock(disk, &sb);
+    }
+    int failed = -1, err = 0;
+    for (int f = 0; f < pendingCount; f++) {
+        struct FlushPlan *fp = &plan[f];
+        struct DirEntry entry = { .flags = 0, .firstBlock = fp->firstBlock, .size = fp->size };
+        int e = 0;
+        if (fp->pack == DIRENT_INLINE) {
+            entry.flags = DIRENT_INLINE;
+            memcpy(entry.data, fp->packed, fp->size);
+        } else if (fp->pack == DIRENT_TAIL && TailAlloc(disk, fat, &sb, fp->packed, &entry) < 0) {
+            e = -4;
+        }
+        if (e == 0 && fp->existing) {
+            // The old entry stays valid until this succeeds: only then do
+            // its rewritten last block and its tail go
+            int r = UpdatePath(disk, fat, &sb, pending[f].name, &entry);
+            if (r == 0) {
+                if (fp->dropped) fat[fp->dropped] = 0;
+                TailFree(disk, fat, &sb, &fp->old);
+                continue;
+            }
+            TailFree(disk, fat, &sb, &entry);
+            e = r == -4 ? -4 : -5;
+        } else if (e == 0) {
+            e = AddPath(disk, fat, &sb, pending[f].name, &entry);
+            if (e < 0) TailFree(disk, fat, &sb, &entry);
+        }
+        if (e < 0) {
+            // no room for the tail, someone took the name (or removed the
+            // directory) while we copied, or the appended entry could not
+            // be rewritten
+            for (int k = 0; k < fp->count; k++) fat[fp->blk[k]] = 0;
+            if (fp->lastKept) fat[fp->lastKept] = fp->keptLink;
+            if (failed < 0) { failed = f; err = e; }
+        }
+    }
+    if (sb.snapCount > 0) ApplyPinned(fat, pinned);
+    StoreFAT(disk, fat, &sb);
+    LockRegion(disk, F_UNLCK, 0, 0);
+    if (failed >= 0) {
+        if (err == -4)      fprintf(stderr, "Not enough free space\n");
+        else if (err == -5) fprintf(stderr, "Error updating directory entry: %s\n", pending[failed].name);
+        else                PathError(err, pending[failed].name);
+        exit(EXIT_FAILURE);
+    }
 
-    printf("Duplicated '%s' -> '%s' (%u bytes)\n",
-           srcFileName, newName, filesize);
+    printf("Flushed %d file(s): %d blocks in %d write(s)\n", pendingCount, total, writes);
 
     // cleanup
+    for (int f = 0; f < pendingCount; f++) {
+        free(plan[f].tail);
+        free(plan[f].idx);
+        free(plan[f].src);
+        free(plan[f].blk);
+        free(pending[f].data);
+    }
+    free(pending);
+    pending = NULL;
+    pendingCount = 0;
+    pendingBytes = 0;
+    free(plan);
+    free(dirty);
+    free(staging);
     free(fat);
-    free(origFat);
     free(chain);
+    free(holes);
     fclose(disk);
 }
 
-
-void Search(const char *disk_path, const char *srcFileName) {
-    FILE *disk = fopen(disk_path, "rb");
-    if (!disk) {
-        perror("Error opening disk image");
+/* Buffer a host file, or add it to a buffered file of the same name */
+static void QueueWrite(const char *disk_path, const char *srcPath, const char *destFileName, int append) {
+    int src = open(srcPath, O_RDONLY);
+    if (src < 0) {
+        perror("Error opening source file");
+        FlushPending(disk_path);
         exit(EXIT_FAILURE);
     }
+    off_t size = lseek(src, 0, SEEK_END);
 
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    int found = 0;
-
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        char namebuf[248] = {0};
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-
-        /* skip empty entries */
-        if (namebuf[0] == '\0')
-            continue;
-
-        if (strcmp(namebuf, srcFileName) == 0) {
-            found = 1;
-            break;
+    struct PendingFile *pf = NULL;
+    if (append) {
+        for (int i = pendingCount; i-- > 0; ) {
+            if (strcmp(pending[i].name, destFileName) == 0) { pf = &pending[i]; break; }
         }
     }
+    if (!pf) {
+        pending = realloc(pending, (pendingCount + 1) * sizeof(struct PendingFile));
+        if (!pending) { perror("Allocating write buffer"); exit(EXIT_FAILURE); }
+        pf = &pending[pendingCount++];
+        memset(pf, 0, sizeof(*pf));
+        strncpy(pf->name, destFileName, sizeof(pf->name) - 1);
+        pf->append = append;
+    }
 
-    fclose(disk);
-    printf(found ? "YES\n" : "NO\n");
-}
+    pf->data = realloc(pf->data, pf->len + size + 1);
+    if (!pf->data) { perror("Allocating write buffer"); exit(EXIT_FAILURE); }
+    for (off_t done = 0; done < size; ) {
+        ssize_t r = pread(src, pf->data + pf->len + done, size - done, done);
+        if (r <= 0) { perror("Error reading source file"); exit(EXIT_FAILURE); }
+        done += r;
+    }
+    close(src);
 
+    if (pendingBytes == 0) pendingSince = time(NULL);
+    pf->len += size;
+    pendingBytes += size;
+    printf("Buffered '%s' -> '%s' (%ld bytes)\n", srcPath, destFileName, (long)size);
 
-void Hide(const char *disk_path, const char *srcFileName) {
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) {
-        perror("Error opening disk image");
-        exit(EXIT_FAILURE);
-    }
+    if (pendingBytes >= bufferLimit) FlushPending(disk_path);
+}
 
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    char namebuf[248];
-    int slot = -1;
 
-    // 1) Find the slot for srcFileName
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        memset(namebuf, 0, sizeof(namebuf));
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, sizeof(namebuf), disk);
-        if (strcmp(namebuf, srcFileName) == 0) {
-            slot = i;
-            break;
-        }
-    }
-    if (slot < 0) {
-        fprintf(stderr, "File not found: %s\n", srcFileName);
-        fclose(disk);
-        exit(EXIT_FAILURE);
-    }
+/* Append a host file to a file on the image (created if missing) */
+void Append(const char *disk_path, const char *srcPath, const char *destFileName) {
+    QueueWrite(disk_path, srcPath, destFileName, 1);
+    FlushPending(disk_path);
+}
 
-    // 2) Build hidden name: prefix '.' and truncate if necessary
-    char hidden[248] = {0};
-    hidden[0] = '.';
-    // leave room for the leading dot plus up to 246 chars of original name
-    strncpy(hidden + 1, srcFileName, sizeof(hidden) - 2);
-    hidden[sizeof(hidden)-1] = '\0';
 
-    // 3) Write it back into the directory entry
-    fseek(disk, filelist_offset + slot*256, SEEK_SET);
-    fwrite(hidden, 1, sizeof(hidden), disk);
+/* Flush buffered writes and force the image to stable storage */
+void SyncImage(const char *disk_path) {
+    FlushPending(disk_path);
 
-    printf("Hidden '%s'\n", srcFileName);
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+    struct Volume plain, *v = VolumeOf(disk, &plain);
+    for (int m = 0; m < v->members; m++) {
+        if (fsync(v->fd[m]) < 0) { perror("fsync failed"); fclose(disk); exit(EXIT_FAILURE); }
+    }
     fclose(disk);
+    printf("Disk image \"%s\" synced.\n", disk_path);
 }
 
 
-void Unhide(const char *disk_path, const char *srcFileName) {
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) {
-        perror("Error opening disk image");
-        exit(EXIT_FAILURE);
+/*
+ * Read one line from fd, waiting at most timeoutMs (-1 = forever).
+ * Returns 1 for a line, 0 at end of input, -1 on timeout.
+ */
+static int ReadLine(int fd, char *line, size_t size, int timeoutMs) {
+    static char buf[4096];
+    static size_t have;
+
+    while (1) {
+        char *nl = memchr(buf, '\n', have);
+        if (nl || have == sizeof(buf)) {
+            size_t len = nl ? (size_t)(nl - buf) : have;
+            size_t keep = len < size - 1 ? len : size - 1;
+            memcpy(line, buf, keep);
+            line[keep] = '\0';
+            size_t used = nl ? len + 1 : len;
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            return 1;
+        }
+        if (timeoutMs >= 0) {
+            struct pollfd p = { .fd = fd, .events = POLLIN };
+            if (poll(&p, 1, timeoutMs) == 0) return -1;
+        }
+        ssize_t r = read(fd, buf + have, sizeof(buf) - have);
+        if (r <= 0) {
+            if (have == 0) return 0;
+            buf[have++] = '\n';   // last line without a newline
+            continue;
+        }
+        have += r;
     }
+}
 
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    char namebuf[248];
-    int slot = -1;
 
-    // 1) Find the entry named ".srcFileName"
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        memset(namebuf, 0, sizeof(namebuf));
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf, 1, sizeof(namebuf), disk);
-        if (namebuf[0] == '.' && strcmp(namebuf + 1, srcFileName) == 0) {
-            slot = i;
-            break;
+/*
+ * Split a batch line into words in place, like a shell: blanks separate
+ * words, "..." and '...' quote, and a backslash escapes the next character
+ * (outside single quotes). Returns the number of words, or -1 for an
+ * unterminated quote or more than max words.
+ */
+static int SplitLine(char *line, char **words, int max) {
+    int n = 0;
+    char *in = line, *out = line;
+    while (1) {
+        while (*in == ' ' || *in == '\t' || *in == '\r') in++;
+        if (*in == '\0') return n;
+        if (n == max) return -1;
+        words[n++] = out;
+        char quote = 0;
+        for (; *in; in++) {
+            if (quote) {
+                if (*in == quote) quote = 0;
+                else if (*in == '\\' && quote == '"' && in[1]) *out++ = *++in;
+                else *out++ = *in;
+            } else if (*in == '"' || *in == '\'') {
+                quote = *in;
+            } else if (*in == '\\' && in[1]) {
+                *out++ = *++in;
+            } else if (*in == ' ' || *in == '\t' || *in == '\r') {
+                break;
+            } else {
+                *out++ = *in;
+            }
         }
+        if (quote) return -1;
+        if (*in) in++;
+        *out++ = '\0';
     }
-    if (slot < 0) {
-        fprintf(stderr, "Hidden file not found: %s\n", srcFileName);
-        fclose(disk);
-        exit(EXIT_FAILURE);
+}
+
+/**
+ * Run commands from a script (or "-" for stdin), one per line, written
+ * like on the command line without the disk: "-write src name". Names
+ * with blanks are quoted ("my file") or escaped (my\ file).
+ * -write and -append lines are buffered (see FlushPending); -sync flushes
+ * them; any other command flushes first and then runs normally.
+ */
+void Batch(const char *disk_path, const char *scriptPath) {
+    int fd = strcmp(scriptPath, "-") == 0 ? STDIN_FILENO : open(scriptPath, O_RDONLY);
+    if (fd < 0) { perror("Error opening batch script"); exit(EXIT_FAILURE); }
+
+    char line[4096];
+    while (1) {
+        // Wait for the next command, but not past the flush deadline
+        int timeoutMs = -1;
+        if (pendingCount > 0) {
+            long left = (long)(pendingSince + flushInterval - time(NULL));
+            if (left <= 0) { TracedFlush(disk_path); fflush(stdout); continue; }
+            timeoutMs = (int)(left * 1000);
+        }
+        int r = ReadLine(fd, line, sizeof(line), timeoutMs);
+        if (r < 0) { TracedFlush(disk_path); fflush(stdout); continue; }
+        if (r == 0) break;
+
+        // Split into argv: program, disk, command, args
+        if (line[strspn(line, " \t\r")] == '#') continue;
+        char *args[16] = { "myfs", (char *)disk_path };
+        char original[sizeof(line)];
+        strcpy(original, line);
+        int n = SplitLine(line, args + 2, 13);
+        if (n < 0) {
+            fprintf(stderr, "Bad batch line (unterminated quote or too many words): %s\n", original);
+            exit(EXIT_FAILURE);
+        }
+        n += 2;
+        args[n] = NULL;
+        if (n == 2) continue;
+
+        struct stat st;
+        if (strcmp(args[2], "-write") == 0 && n == 5 &&
+            stat(args[3], &st) == 0 && (size_t)st.st_size > bufferLimit) {
+            // Too big to buffer: write it straight through
+            TraceBegin(n, args, 0);
+            FlushPending(disk_path);
+            Write(disk_path, args[3], args[4]);
+            TraceEnd(0);
+        }
+        else if ((strcmp(args[2], "-write") == 0 || strcmp(args[2], "-append") == 0) && n == 5) {
+            TraceBegin(n, args, TRACE_BUFFERED);
+            QueueWrite(disk_path, args[3], args[4], strcmp(args[2], "-append") == 0);
+            TraceEnd(0);
+        }
+        else {
+            TraceBegin(n, args, 0);
+            FlushPending(disk_path);
+            int status = RunCommand(n, args);
+            TraceEnd(status);
+            if (status != 0) exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
     }
 
-    // 2) Prepare the un-hidden name buffer (zero-padded)
-    char unhidden[248] = {0};
-    strncpy(unhidden, srcFileName, sizeof(unhidden) - 1);
+    TracedFlush(disk_path);
+    if (fd != STDIN_FILENO) close(fd);
+}
 
-    // 3) Write it back into the directory entry
-    fseek(disk, filelist_offset + slot*256, SEEK_SET);
-    fwrite(unhidden, 1, sizeof(unhidden), disk);
 
-    printf("Unhidden '%s'\n", srcFileName);
-    fclose(disk);
+/*   Incremental update (-sync)   */
+
+/*
+ * rsync's weak checksum: two 16-bit running sums that can be rolled along
+ * a byte at a time. Image blocks are BLOCK_SIZE-aligned, so -sync only
+ * evaluates it at block boundaries of the host file.
+ */
+static uint32_t WeakChecksum(const unsigned char *buf, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += buf[i];
+        b += (uint32_t)(len - i) * buf[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+/* 64-bit FNV-1a: the strong hash that confirms a weak match */
+static uint64_t StrongHash(const unsigned char *buf, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
+/* Is an entry still the one loaded before? (same chain start, size and packed end) */
+static int SameEntry(const struct DirEntry *a, const struct DirEntry *b) {
+    if (a->flags != b->flags || a->firstBlock != b->firstBlock || a->size != b->size) return 0;
+    if ((a->flags & DIRENT_TAIL) && (a->tailBlock != b->tailBlock || a->tailOff != b->tailOff)) return 0;
+    if ((a->flags & DIRENT_INLINE) && memcmp(a->data, b->data, a->size) != 0) return 0;
+    return 1;
+}
 
 /**
- * Reads all 128 entries and writes them to "filelist.txt" in the format:
- *   idx name firstBlock fileSize
- * where idx is three digits (000–127), name is the filename or "NULL" if empty,
- * firstBlock and fileSize are decimal.
+ * Bring a file on the image up to date with a host file, rewriting only
+ * the blocks that changed. Every block of the old chain and of the host
+ * file is hashed; a host block whose weak and strong hashes (and bytes)
+ * match an old block reuses that block, even if it moved to another
+ * position. Changed blocks go to newly reserved blocks, like in Write, and
+ * a short commit relinks the chain and frees the old blocks that are no
+ * longer used (unless a snapshot still references them). A small result is
+ * packed inline or into a tail block like a written file.
  */
-void PrintFileList(const char *disk_path) {
-    FILE *disk = fopen(disk_path, "rb");
-    if (!disk) {
-        perror("Error opening disk image");
+void SyncFile(const char *disk_path, const char *srcPath, const char *destFileName) {
+    // Open source file
+    int src = open(srcPath, O_RDONLY);
+    if (src < 0) { perror("Error opening source file"); exit(EXIT_FAILURE); }
+    off_t filesize = lseek(src, 0, SEEK_END);
+    if (filesize < 0 || filesize > (off_t)UINT32_MAX) {
+        fprintf(stderr, "Source file too large: %s\n", srcPath);
+        close(src);
         exit(EXIT_FAILURE);
     }
-
-    // Open the output text file
-    FILE *out = fopen("filelist.txt", "w");
-    if (!out) {
-        perror("Error creating filelist.txt");
+    uint32_t blocks = (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    FILE *disk = OpenDisk(disk_path, "r+b");
+    if (!disk) { perror("Error opening disk image"); close(src); exit(EXIT_FAILURE); }
+
+    // Keep Defragment from moving blocks until the commit; the old chain
+    // is read under a shared metadata lock, so it cannot be freed meanwhile
+    LockRegion(disk, F_RDLCK, META_END, 0);
+    LockRegion(disk, F_RDLCK, 0, META_END);
+
+    // 1) Find the file; if it is not on the image yet, this is a plain Write
+    struct Superblock sb;
+    LoadSuperblock(disk, &sb);
+    struct DirEntry entry;
+    int found = LookupPath(disk, &sb, destFileName, NULL, &entry) == 1;
+    if (found && (entry.flags & DIRENT_DIR)) {
+        fprintf(stderr, "Is a directory: %s\n", destFileName);
+        close(src);
         fclose(disk);
         exit(EXIT_FAILURE);
     }
+    if (!found) {
+        close(src);
+        fclose(disk);
+        Write(disk_path, srcPath, destFileName);
+        return;
+    }
 
-    // Where the 128 directory entries begin
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        // Read name (248 bytes), first block (4 bytes), file size (4 bytes)
-        char namebuf[248] = {0};
-        uint32_t firstBlock = 0, fileSize = 0;
-
-        // seek to entry i
-        fseek(disk, filelist_offset + i * 256, SEEK_SET);
-        fread(namebuf, 1, 248, disk);
-        fread(&firstBlock, sizeof(firstBlock), 1, disk);
-        fread(&fileSize,  sizeof(fileSize),  1, disk);
-
-        // If name is empty, print "NULL"
-        const char *displayName = (namebuf[0] == '\0') ? "NULL" : namebuf;
+    // 2) Load FAT and the old chain, and read every old block
+    uint32_t *fat      = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *oldBlk   = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *oldHoles = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *curBlk   = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    uint32_t *curHoles = malloc(FAT_ENTRIES * sizeof(uint32_t));
+    if (!fat || !oldBlk || !oldHoles || !curBlk || !curHoles) { perror("Allocating FAT"); exit(EXIT_FAILURE); }
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    int n = LoadChain(fat, entry.firstBlock, oldBlk, oldHoles);
+
+    unsigned char *oldData = malloc((size_t)(n ? n : 1) * BLOCK_SIZE);
+    char **bufs = malloc((n ? n : 1) * sizeof(char *));
+    if (!oldData || !bufs) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    for (int k = 0; k < n; k++) bufs[k] = (char *)oldData + (size_t)k * BLOCK_SIZE;
+    if (n > 0) TransferBlocks(disk, oldBlk, n, bufs, 0);
+    free(bufs);
+    LockRegion(disk, F_UNLCK, 0, META_END);
+
+    // 3) Hash the old blocks: open-addressing table from weak checksum to block
+    uint32_t *oldIdx  = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *weak    = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint64_t *strong  = malloc((n ? n : 1) * sizeof(uint64_t));
+    uint8_t  *claimed = calloc(n ? n : 1, 1);
+    if (!oldIdx || !weak || !strong || !claimed) { perror("Allocating hashes"); exit(EXIT_FAILURE); }
+    int tableSize = 2 * FAT_ENTRIES;
+    int *table = malloc(tableSize * sizeof(int));
+    if (!table) { perror("Allocating hash table"); exit(EXIT_FAILURE); }
+    for (int t = 0; t < tableSize; t++) table[t] = -1;
+
+    uint32_t idx = 0;
+    for (int k = 0; k < n; k++) {
+        idx += oldHoles[k] + (k > 0);
+        oldIdx[k] = idx;
+        weak[k]   = WeakChecksum(oldData + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        strong[k] = StrongHash(oldData + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        int t = weak[k] % tableSize;
+        while (table[t] >= 0) t = (t + 1) % tableSize;
+        table[t] = k;
+    }
 
-        // Write a line: "000 FileA 1 2000"
-        fprintf(out, "%03d %s %u %u\n", i, displayName, firstBlock, fileSize);
+    // 4) Scan the host file the same way Write does
+    uint8_t *isData;
+    char *data;
+    int m = ScanSource(src, filesize, &isData, &data);
+    close(src);
+
+    uint32_t *newIdx = malloc((m ? m : 1) * sizeof(uint32_t));
+    const unsigned char **newSrc = malloc((m ? m : 1) * sizeof(char *));
+    int *match = malloc((m ? m : 1) * sizeof(int));
+    uint32_t *newBlk = malloc((m ? m : 1) * sizeof(uint32_t));
+    if (!newIdx || !newSrc || !match || !newBlk) { perror("Allocating plan"); exit(EXIT_FAILURE); }
+    static const unsigned char zeroBlock[BLOCK_SIZE] = {0};
+    const char *next = data;
+    int i = 0;
+    for (uint32_t j = 0; j < blocks; j++) {
+        if (!isData[j]) continue;
+        newIdx[i] = j;
+        newSrc[i] = zeroBlock;
+        if (isData[j] == 1) { newSrc[i] = (const unsigned char *)next; next += BLOCK_SIZE; }
+        match[i] = -1;
+        i++;
     }
 
-    fclose(out);
-    fclose(disk);
+    // A small file's last data block is packed instead of getting a block
+    int pack = (m > 0 && isData[blocks - 1] == 1) ? PackKind(filesize) : 0;
+    const char *tail = NULL;
+    if (pack) tail = (const char *)newSrc[--m];
+
+    // 5a) Blocks unchanged at the same position stay where they are
+    for (int a = 0, k = 0; a < m && k < n; ) {
+        if (oldIdx[k] < newIdx[a]) { k++; continue; }
+        if (oldIdx[k] > newIdx[a]) { a++; continue; }
+        if (memcmp(oldData + (size_t)k * BLOCK_SIZE, newSrc[a], BLOCK_SIZE) == 0) {
+            match[a] = k;
+            claimed[k] = 1;
+        }
+        a++; k++;
+    }
 
-    printf("File list written to filelist.txt\n");
-}
+    // 5b) Other blocks: look for the same contents anywhere in the old chain
+    for (int a = 0; a < m && n > 0; a++) {
+        if (match[a] >= 0) continue;
+        uint32_t w = WeakChecksum(newSrc[a], BLOCK_SIZE);
+        uint64_t h = 0;
+        int hashed = 0;
+        for (int t = w % tableSize; table[t] >= 0; t = (t + 1) % tableSize) {
+            int k = table[t];
+            if (claimed[k] || weak[k] != w) continue;
+            if (!hashed) { h = StrongHash(newSrc[a], BLOCK_SIZE); hashed = 1; }
+            if (strong[k] != h) continue;
+            if (memcmp(oldData + (size_t)k * BLOCK_SIZE, newSrc[a], BLOCK_SIZE) != 0) continue;
+            match[a] = k;
+            claimed[k] = 1;
+            break;
+        }
+    }
 
+    // 6) Reserve blocks for the changed data under a short exclusive lock
+    uint32_t *fresh = malloc((m ? m : 1) * sizeof(uint32_t));
+    char **freshBuf = malloc((m ? m : 1) * sizeof(char *));
+    if (!fresh || !freshBuf) { perror("Allocating chain"); exit(EXIT_FAILURE); }
+    int skipped = 0, written = 0;
+    for (int a = 0; a < m; a++) {
+        if (match[a] >= 0) { newBlk[a] = oldBlk[match[a]]; skipped++; continue; }
+        freshBuf[written++] = (char *)newSrc[a];
+    }
 
-void PrintFAT(const char *disk_path) {
-    FILE *disk = fopen(disk_path, "rb");
-    if (!disk) {
-        perror("Error opening disk image");
+    LockRegion(disk, F_WRLCK, 0, META_END);
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    LoadSuperblock(disk, &sb);
+    int got = 0;
+    for (int b = 1; b < FAT_ENTRIES && got < written; b++) {
+        if (fat[b] == 0) fresh[got++] = b;
+    }
+    if (got < written) {
+        fprintf(stderr, "Not enough free space\n");
         exit(EXIT_FAILURE);
     }
+    for (int k = 0; k < written; k++) fat[fresh[k]] = FAT_EOC;
+    StoreFAT(disk, fat, &sb);
+    LockRegion(disk, F_UNLCK, 0, META_END);
+    for (int a = 0, k = 0; a < m; a++) {
+        if (match[a] < 0) newBlk[a] = fresh[k++];
+    }
 
-    FILE *out = fopen("fat.txt", "w");
-    if (!out) {
-        perror("Error creating fat.txt");
-        fclose(disk);
+    // 7) Write the changed blocks (no metadata lock held)
+    TransferBlocks(disk, fresh, written, freshBuf, 1);
+
+    // 8) Commit: the file must still be the one we read
+    LockRegion(disk, F_WRLCK, 0, META_END);
+    fseek(disk, 0, SEEK_SET);
+    fread(fat, sizeof(uint32_t), FAT_ENTRIES, disk);
+    LoadSuperblock(disk, &sb);
+    struct DirEntry cur;
+    int same = LookupPath(disk, &sb, destFileName, NULL, &cur) == 1 && SameEntry(&cur, &entry) &&
+               LoadChain(fat, cur.firstBlock, curBlk, curHoles) == n &&
+               memcmp(curBlk, oldBlk, n * sizeof(uint32_t)) == 0 &&
+               memcmp(curHoles, oldHoles, n * sizeof(uint32_t)) == 0;
+
+    struct DirEntry update = entry;
+    update.flags     &= ~(DIRENT_INLINE | DIRENT_TAIL);
+    update.firstBlock = FAT_EOC;
+    update.size       = (uint32_t)filesize;
+    int64_t prevIdx = -1;
+    for (int a = 0; a < m; a++) {
+        uint32_t link = MAKE_LINK(newBlk[a], newIdx[a] - prevIdx - 1);
+        if (a == 0) update.firstBlock = link;
+        prevIdx = newIdx[a];
+    }
+    int err = same ? 0 : -1;
+    if (err == 0 && pack == DIRENT_INLINE) {
+        update.flags |= DIRENT_INLINE;
+        memcpy(update.data, tail, filesize);
+    } else if (err == 0 && pack == DIRENT_TAIL && TailAlloc(disk, fat, &sb, tail, &update) < 0) {
+        err = -4;
+    }
+    if (err == 0 && UpdatePath(disk, fat, &sb, destFileName, &update) < 0) {
+        TailFree(disk, fat, &sb, &update);
+        err = -4;
+    }
+    if (err < 0) {
+        // the file changed while we copied, or there is no room for the
+        // tail or the updated record: the old file stays as it was
+        for (int k = 0; k < written; k++) fat[fresh[k]] = 0;
+        StoreFAT(disk, fat, &sb);
+        LockRegion(disk, F_UNLCK, 0, 0);
+        if (err == -4) fprintf(stderr, "Not enough free space\n");
+        else           fprintf(stderr, "File changed during sync: %s\n", destFileName);
         exit(EXIT_FAILURE);
     }
 
-    const int ENTRIES_PER_ROW = 4;
-    uint32_t entry;
-    for (int i = 0; i < FAT_ENTRIES; i++) {
-        // read next FAT entry
-        if (fread(&entry, sizeof(entry), 1, disk) != 1) {
-            perror("Error reading FAT entry");
-            fclose(disk);
-            fclose(out);
-            exit(EXIT_FAILURE);
+    // Free the old blocks that were not kept and the old packed end, then
+    // link the new chain
+    uint8_t pinned[FAT_ENTRIES];
+    LoadPinned(disk, fat, &sb, pinned);
+    uint32_t *released = malloc((n + 1) * sizeof(uint32_t));
+    if (!released) { perror("Allocating free list"); exit(EXIT_FAILURE); }
+    int releasedCount = 0;
+    for (int k = 0; k < n; k++) {
+        if (!claimed[k]) { fat[oldBlk[k]] = 0; released[releasedCount++] = oldBlk[k]; }
+    }
+    uint32_t tailBlk = TailFree(disk, fat, &sb, &entry);
+    if (tailBlk) released[releasedCount++] = tailBlk;
+    for (int a = 1; a < m; a++) fat[newBlk[a-1]] = MAKE_LINK(newBlk[a], newIdx[a] - newIdx[a-1] - 1);
+    if (m > 0) fat[newBlk[m-1]] = FAT_EOC;
+    ApplyPinned(fat, pinned);
+
+    if (discardMode) {
+        int r = 0;
+        for (int k = 0; k < releasedCount; k++) {
+            if (fat[released[k]] == 0) released[r++] = released[k];
         }
+        ReleaseBlockList(disk, released, r);
+    }
 
-        
-        fprintf(out, "%04d\t%08X", i, entry);
+    StoreFAT(disk, fat, &sb);
+    LockRegion(disk, F_UNLCK, 0, 0);
 
-        // separator or newline every ENTRIES_PER_ROW
-        if ((i + 1) % ENTRIES_PER_ROW == 0) {
-            fputc('\n', out);
-        } else {
-            fputc('\t', out);
-        }
-    }
+    printf("Synced '%s' -> '%s' (size: %ld bytes): %d blocks skipped, %d written, %d freed\n",
+           srcPath, destFileName, (long)filesize, skipped, written, releasedCount);
 
-    fclose(out);
+    free(fat); free(oldBlk); free(oldHoles); free(curBlk); free(curHoles);
+    free(oldData); free(oldIdx);
+    free(weak); free(strong); free(claimed); free(table);
+    free(isData); free(data);
+    free(newIdx); free(newSrc); free(match); free(newBlk); free(released);
+    free(fresh); free(freshBuf);
     fclose(disk);
-    printf("FAT written to fat.txt\n");
 }
 
 
-void Defragment(const char *disk_path) {
-    FILE *disk = fopen(disk_path, "r+b");
-    if (!disk) { perror("Error opening disk image"); exit(EXIT_FAILURE); }
+/*   Operation tracing (--trace) and replay (myfs-replay)   */
 
-    // 1) Load current FAT
-    uint32_t *oldFAT = malloc(FAT_ENTRIES * sizeof(uint32_t));
-    if (!oldFAT) { perror("Allocating oldFAT"); fclose(disk); exit(EXIT_FAILURE); }
-    fseek(disk, 0, SEEK_SET);
-    fread(oldFAT, sizeof(uint32_t), FAT_ENTRIES, disk);
+/*
+ * A trace is the magic "MYFSTRC1" followed by one TraceRecord per command,
+ * each followed by its NUL-separated arguments (command name first, without
+ * the program and disk). Batch lines are recorded one by one; timed flushes
+ * of buffered writes appear as a "-flush" record. Several processes may
+ * append to the same trace; a record goes out in one write under an fcntl
+ * lock, in order of completion.
+ */
+struct TraceRecord {
+    uint64_t start;     // wall-clock start, ns since the epoch
+    uint64_t latency;   // ns
+    uint64_t size;      // bytes moved: host source file, or host file read out
+    uint64_t offset;    // where appended data lands in the file (0 otherwise)
+    uint32_t pid;
+    uint16_t argLen;    // bytes of arguments that follow
+    uint8_t  argc;
+    uint8_t  flags;
+};
 
-    // 2) Scan file-list and read every file's blocks into memory
-    long filelist_offset = FAT_ENTRIES * sizeof(uint32_t);
-    typedef struct {
-        int      slot;    // directory slot
-        uint32_t blocks;  // number of blocks
-        char    *data;    // all block data concatenated
-    } DefragEntry;
+static struct TraceRecord traceRec;      /* command in progress */
+static char     traceArgs[1024];
+static char     traceOut[256];           /* host file a -read writes */
+static uint64_t traceT0;
+static int      traceActive;
 
-    DefragEntry *files = malloc(FILE_ENTRIES * sizeof(DefragEntry));
-    if (!files) { perror("Allocating files array"); free(oldFAT); fclose(disk); exit(EXIT_FAILURE); }
-    int fileCount = 0;
-
-    for (int i = 0; i < FILE_ENTRIES; i++) {
-        // read name, first block, size
-        char namebuf[248] = {0};
-        uint32_t firstBlock = 0, filesize = 0;
-        fseek(disk, filelist_offset + i*256, SEEK_SET);
-        fread(namebuf,     1, sizeof(namebuf), disk);
-        fread(&firstBlock, sizeof(firstBlock), 1, disk);
-        fread(&filesize,   sizeof(filesize),   1, disk);
-        if (namebuf[0] == '\0') continue;  // empty entry
-
-        uint32_t blocks = (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-        // build chain of old block indices
-        uint32_t *chain = malloc(blocks * sizeof(uint32_t));
-        if (!chain) { perror("Allocating chain"); exit(EXIT_FAILURE); }
-        uint32_t cur = firstBlock;
-        for (uint32_t b = 0; b < blocks; b++) {
-            chain[b] = cur;
-            cur = oldFAT[cur];
-        }
+static uint64_t NowNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-        // read all blocks into one buffer
-        char *data = malloc(blocks * BLOCK_SIZE);
-        if (!data) { perror("Allocating data buffer"); exit(EXIT_FAILURE); }
-        off_t data_start = FAT_ENTRIES * sizeof(uint32_t)
-                         + FILE_ENTRIES  * 256;
-        size_t remaining = filesize;
-        for (uint32_t b = 0; b < blocks; b++) {
-            fseek(disk, data_start + chain[b] * BLOCK_SIZE, SEEK_SET);
-            size_t to_read = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
-            fread(data + b*BLOCK_SIZE, 1, to_read, disk);
-            if (to_read < BLOCK_SIZE)
-                memset(data + b*BLOCK_SIZE + to_read, 0, BLOCK_SIZE - to_read);
-            remaining = (remaining > to_read ? remaining - to_read : 0);
-        }
-        free(chain);
+/* Current size of a file on the image plus what is still buffered for it */
+static uint64_t TracedFileSize(const char *disk_path, const char *name) {
+    uint64_t size = 0;
+    FILE *disk = OpenDisk(disk_path, "rb");
+    if (disk) {
+        struct Superblock sb;
+        struct DirEntry e;
+        LockRegion(disk, F_RDLCK, 0, META_END);
+        LoadSuperblock(disk, &sb);
+        if (LookupPath(disk, &sb, name, NULL, &e) == 1) size = e.size;
+        fclose(disk);
+    }
+    for (int i = 0; i < pendingCount; i++) {
+        if (strcmp(pending[i].name, name) == 0) size = pending[i].append ? size + pending[i].len : pending[i].len;
+    }
+    return size;
+}
 
-        files[fileCount].slot   = i;
-        files[fileCount].blocks = blocks;
-        files[fileCount].data   = data;
-        fileCount++;
+/* Write the record of the command in progress */
+static void TraceEnd(int status) {
+    if (!traceActive) return;
+    traceActive = 0;
+    traceRec.latency = NowNs(CLOCK_MONOTONIC) - traceT0;
+    if (status != 0) traceRec.flags |= TRACE_FAILED;
+    struct stat st;
+    if (traceOut[0] && stat(traceOut, &st) == 0) traceRec.size = st.st_size;
+
+    int fd = open(tracePath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) { perror("Error opening trace file"); return; }
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    while (fcntl(fd, F_SETLKW, &fl) < 0 && errno == EINTR) ;
+
+    char buf[sizeof(TRACE_MAGIC) - 1 + sizeof(traceRec) + sizeof(traceArgs)];
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        memcpy(buf, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+        len = sizeof(TRACE_MAGIC) - 1;
     }
-    free(oldFAT);
+    memcpy(buf + len, &traceRec, sizeof(traceRec));
+    memcpy(buf + len + sizeof(traceRec), traceArgs, traceRec.argLen);
+    len += sizeof(traceRec) + traceRec.argLen;
+    if (write(fd, buf, len) != (ssize_t)len) perror("Error writing trace file");
+    close(fd);   // drops the lock
+}
 
-    // 3) Build a fresh FAT
-    uint32_t *newFAT = calloc(FAT_ENTRIES, sizeof(uint32_t));
-    if (!newFAT) { perror("Allocating newFAT"); exit(EXIT_FAILURE); }
-    newFAT[0] = 0xFFFFFFFF;  // reserved
+/* Commands exit() on errors: record them as failed */
+static void TraceAtExit(void) {
+    TraceEnd(EXIT_FAILURE);
+}
 
-    // 4) Write each file back contiguously
-    off_t data_start = FAT_ENTRIES * sizeof(uint32_t)
-                     + FILE_ENTRIES  * 256;
-    uint32_t nextFree = 1;
+/**
+ * Start recording a command; argv is the full command line
+ * (program, disk, command, args) as RunCommand gets it.
+ */
+static void TraceBegin(int argc, char *argv[], int flags) {
+    static int registered;
+    if (!tracePath || strcmp(argv[2], "-batch") == 0) return;  // its lines are recorded instead
+    if (!registered) { atexit(TraceAtExit); registered = 1; }
+
+    memset(&traceRec, 0, sizeof(traceRec));
+    traceRec.pid   = getpid();
+    traceRec.flags = flags | (discardMode ? TRACE_DISCARD : 0);
+    traceRec.argc  = argc - 2;
+    size_t len = 0;
+    for (int i = 2; i < argc; i++) {
+        size_t l = strlen(argv[i]) + 1;
+        if (len + l > sizeof(traceArgs)) { traceRec.argc = i - 2; break; }
+        memcpy(traceArgs + len, argv[i], l);
+        len += l;
+    }
+    traceRec.argLen = len;
+
+    // Sizes and offsets, so that replay can synthesize the host files
+    const char *cmd = argv[2];
+    struct stat st;
+    traceOut[0] = '\0';
+    if (argc == 5 && (strcmp(cmd, "-write") == 0 || strcmp(cmd, "-append") == 0 ||
+                      strcmp(cmd, "-sync") == 0)) {
+        if (stat(argv[3], &st) == 0) traceRec.size = st.st_size;
+        if (strcmp(cmd, "-append") == 0) traceRec.offset = TracedFileSize(argv[1], argv[4]);
+    }
+    else if (argc == 5 && strcmp(cmd, "-read") == 0) {
+        strncpy(traceOut, argv[4], sizeof(traceOut) - 1);
+    }
 
-    for (int f = 0; f < fileCount; f++) {
-        uint32_t blocks = files[f].blocks;
-        char *data      = files[f].data;
+    traceRec.start = NowNs(CLOCK_REALTIME);
+    traceT0 = NowNs(CLOCK_MONOTONIC);
+    traceActive = 1;
+}
+
+/* Flush buffered writes as a traced operation of its own */
+static void TracedFlush(const char *disk_path) {
+    if (pendingCount == 0) return;
+    char *args[] = { "myfs", (char *)disk_path, "-flush", NULL };
+    TraceBegin(3, args, 0);
+    FlushPending(disk_path);
+    TraceEnd(0);
+}
 
-        for (uint32_t b = 0; b < blocks; b++) {
-            uint32_t newBlk = nextFree + b;
-            // write block
-            fseek(disk, data_start + newBlk * BLOCK_SIZE, SEEK_SET);
-            fwrite(data + b*BLOCK_SIZE, 1, BLOCK_SIZE, disk);
-            // update FAT chain
-            newFAT[newBlk] = (b < blocks - 1 ? newBlk + 1 : 0xFFFFFFFF);
-        }
 
-        // update this file’s firstBlock in directory
-        long entryPos = filelist_offset + files[f].slot * 256 + 248;
-        uint32_t firstNew = nextFree;
-        fseek(disk, entryPos, SEEK_SET);
-        fwrite(&firstNew, sizeof(firstNew), 1, disk);
+/* One operation of a loaded trace */
+struct ReplayOp {
+    struct TraceRecord rec;
+    char  *args[16];   // program, disk, command, args
+    int    argc;
+};
+
+static int compare_replay_start(const void *a, const void *b) {
+    const struct ReplayOp *x = a, *y = b;
+    if (x->rec.start != y->rec.start) return x->rec.start < y->rec.start ? -1 : 1;
+    return 0;
+}
 
-        nextFree += blocks;
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Load a trace, ordered by start time */
+static struct ReplayOp *LoadTrace(const char *path, int *count) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { perror("Error opening trace file"); exit(EXIT_FAILURE); }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "Not a myfs trace: %s\n", path);
+        exit(EXIT_FAILURE);
     }
 
-    // 5) Write the new FAT over the old one
-    fseek(disk, 0, SEEK_SET);
-    fwrite(newFAT, sizeof(uint32_t), FAT_ENTRIES, disk);
+    struct ReplayOp *ops = NULL;
+    int n = 0, cap = 0;
+    struct TraceRecord rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        char *argbuf = malloc(rec.argLen + 1);
+        if (!argbuf || fread(argbuf, 1, rec.argLen, fp) != rec.argLen) {
+            fprintf(stderr, "Truncated trace: %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        argbuf[rec.argLen] = '\0';
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            ops = realloc(ops, cap * sizeof(struct ReplayOp));
+            if (!ops) { perror("Allocating trace"); exit(EXIT_FAILURE); }
+        }
+        struct ReplayOp *op = &ops[n++];
+        op->rec  = rec;
+        op->argc = 2;
+        for (char *p = argbuf; p < argbuf + rec.argLen && op->argc < 15; p += strlen(p) + 1)
+            op->args[op->argc++] = p;
+        op->args[op->argc] = NULL;
+    }
+    fclose(fp);
+    qsort(ops, n, sizeof(struct ReplayOp), compare_replay_start);
+    *count = n;
+    return ops;
+}
 
-    // --- after writing newFAT to disk, scrub all freed blocks ---
-    static char zeroBlock[BLOCK_SIZE] = {0};
-    for (uint32_t b = nextFree; b < FAT_ENTRIES; b++) {
-        off_t scrubOff = data_start + (off_t)b * BLOCK_SIZE;
-        fseek(disk, scrubOff, SEEK_SET);
-        fwrite(zeroBlock, 1, BLOCK_SIZE, disk);
+/* Host file of the recorded size with deterministic contents */
+static void MakeReplaySource(const char *path, uint64_t size, uint64_t seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror("Error creating replay source"); exit(EXIT_FAILURE); }
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    uint64_t buf[BLOCK_SIZE];
+    for (uint64_t done = 0; done < size; ) {
+        for (size_t i = 0; i < sizeof(buf) / 8; i++) {   // xorshift64
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            buf[i] = x;
+        }
+        size_t chunk = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        if (write(fd, buf, chunk) != (ssize_t)chunk) { perror("Error writing replay source"); exit(EXIT_FAILURE); }
+        done += chunk;
     }
+    close(fd);
+}
 
-    // 6) Cleanup
-    for (int f = 0; f < fileCount; f++) free(files[f].data);
-    free(files);
-    free(newFAT);
-    fclose(disk);
+/*
+ * Run ops[first..] in this (child) process, storing each latency in the
+ * shared array and counting completed ops; stops after the first failure.
+ */
+static void ReplayRun(const char *disk_path, struct ReplayOp *ops, int count, int first,
+                      uint64_t *latency, volatile int *done, int paced) {
+    uint64_t traceStart = ops[0].rec.start;
+    uint64_t replayStart = NowNs(CLOCK_MONOTONIC) - (ops[first].rec.start - traceStart);
+
+    for (int i = first; i < count; i++) {
+        struct ReplayOp *op = &ops[i];
+        char *args[16];
+        memcpy(args, op->args, sizeof(args));
+        args[1] = (char *)disk_path;
+        const char *cmd = args[2];
+
+        // Stand-ins for the host files of the recorded run
+        char src[32], out[32];
+        snprintf(src, sizeof(src), "src.%d", i);
+        snprintf(out, sizeof(out), "out.%d", i);
+        if (op->argc == 5 && (strcmp(cmd, "-write") == 0 || strcmp(cmd, "-append") == 0 ||
+                              strcmp(cmd, "-sync") == 0)) {
+            MakeReplaySource(src, op->rec.size, i);
+            args[3] = src;
+        }
+        else if (op->argc == 5 && strcmp(cmd, "-read") == 0) {
+            args[4] = out;
+        }
+        discardMode = (op->rec.flags & TRACE_DISCARD) != 0;
+
+        if (paced) {
+            uint64_t due = replayStart + (op->rec.start - traceStart);
+            uint64_t now = NowNs(CLOCK_MONOTONIC);
+            if (due > now) {
+                struct timespec ts = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+        }
 
-    printf("Disk defragmented successfully.\n");
+        uint64_t t0 = NowNs(CLOCK_MONOTONIC);
+        int status = 0;
+        if (op->rec.flags & TRACE_BUFFERED) {
+            QueueWrite(disk_path, args[3], args[4], strcmp(cmd, "-append") == 0);
+        } else if (strcmp(cmd, "-flush") == 0) {
+            FlushPending(disk_path);
+        } else {
+            FlushPending(disk_path);
+            status = RunCommand(op->argc, args);
+        }
+        latency[i] = NowNs(CLOCK_MONOTONIC) - t0;
+        unlink(src);
+        unlink(out);
+        if (status != 0) exit(EXIT_FAILURE);
+        *done = i + 1;
+    }
+    FlushPending(disk_path);
+    exit(EXIT_SUCCESS);
+}
+
+/* Latency distribution of one operation type, in microseconds */
+static void PrintLatency(const char *name, uint64_t *v, int n, int failed, uint64_t *recorded) {
+    if (n == 0) { printf("%-14s %6d %5d\n", name, failed, failed); return; }
+    qsort(v, n, sizeof(uint64_t), compare_u64);
+    qsort(recorded, n, sizeof(uint64_t), compare_u64);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += v[i];
+    #define PCT(a, p) ((a)[(int)((n - 1) * (p) / 100)] / 1000.0)
+    printf("%-14s %6d %5d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           name, n + failed, failed, sum / n / 1000.0, PCT(v, 50), PCT(v, 90), PCT(v, 99),
+           v[n-1] / 1000.0, PCT(recorded, 50), PCT(recorded, 99));
+    #undef PCT
+}
+
+/* Absolute form of a disk path; each member of a "vol:" list separately */
+static int ResolveDiskPath(const char *disk_path, char *out, size_t size) {
+    char full[4096];
+    if (strncmp(disk_path, "vol:", 4) != 0) {
+        if (!realpath(disk_path, full)) return -1;
+        if ((size_t)snprintf(out, size, "%s", full) >= size) { errno = ENAMETOOLONG; return -1; }
+        return 0;
+    }
+    char list[PATH_LEN * MAX_MEMBERS];
+    snprintf(list, sizeof(list), "%s", disk_path + 4);
+    size_t len = snprintf(out, size, "vol:");
+    for (char *save, *name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (!realpath(name, full)) return -1;
+        len += snprintf(out + len, len < size ? size - len : 0, "%s%s", len > 4 ? "," : "", full);
+        if (len >= size) { errno = ENAMETOOLONG; return -1; }
+    }
+    return 0;
 }
 
+/**
+ * myfs-replay <trace> <disk>: run a recorded trace against an image and
+ * report latency distributions per operation type.
+ *
+ * Host files are replaced by generated files of the recorded sizes, so a
+ * trace taken elsewhere replays without its inputs. Operations run in a
+ * worker process; when one fails (commands exit on errors) it is counted
+ * and a new worker continues with the next operation.
+ */
+int Replay(const char *tracefile, const char *disk_path) {
+    int count;
+    struct ReplayOp *ops = LoadTrace(tracefile, &count);
+    if (count == 0) { printf("Empty trace\n"); return 0; }
+
+    // Workers run in a scratch directory: make the image paths absolute
+    char disk[4096 * MAX_MEMBERS];
+    if (ResolveDiskPath(disk_path, disk, sizeof(disk)) < 0) {
+        perror("Error opening disk image");
+        exit(EXIT_FAILURE);
+    }
+
+    // Command output goes away; only the report is printed
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int savedErr = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    if (replayFresh) Format(disk);
+    if (replayFrom) Rollback(disk, replayFrom);
+    fflush(stdout);
+
+    char tmpdir[] = "/tmp/myfs-replay.XXXXXX";
+    if (!mkdtemp(tmpdir) || chdir(tmpdir) < 0) { perror("Creating replay directory"); exit(EXIT_FAILURE); }
+    dup2(devnull, STDERR_FILENO);
+
+    uint64_t *latency = mmap(NULL, count * sizeof(uint64_t) + sizeof(int), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (latency == MAP_FAILED) { perror("mmap"); exit(EXIT_FAILURE); }
+    volatile int *done = (volatile int *)(latency + count);
+    uint8_t *failed = calloc(count, 1);
+    if (!failed) { perror("Allocating replay"); exit(EXIT_FAILURE); }
+
+    uint64_t t0 = NowNs(CLOCK_MONOTONIC);
+    for (int next = 0; next < count; ) {
+        *done = next;
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork"); exit(EXIT_FAILURE); }
+        if (pid == 0) ReplayRun(disk, ops, count, next, latency, done, replayPaced);
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) break;
+        if (*done >= count) break;   // the final flush failed
+        failed[*done] = 1;           // the op that was running when the worker exited
+        next = *done + 1;
+    }
+    uint64_t total = NowNs(CLOCK_MONOTONIC) - t0;
+
+    dup2(saved, STDOUT_FILENO);
+    dup2(savedErr, STDERR_FILENO);
+    close(saved);
+    close(savedErr);
+    close(devnull);
+    chdir("/");
+    rmdir(tmpdir);   // workers remove their files; a failed op may leave one behind
+
+    // Group by operation type (buffered lines separately)
+    printf("Replayed %d operations in %.3f s%s\n", count, total / 1e9, replayPaced ? " (paced)" : "");
+    printf("%-14s %6s %5s %10s %10s %10s %10s %10s %10s %10s\n",
+           "op", "count", "fail", "mean(us)", "p50", "p90", "p99", "max", "rec p50", "rec p99");
+    uint64_t *v   = malloc(count * sizeof(uint64_t));
+    uint64_t *rec = malloc(count * sizeof(uint64_t));
+    uint8_t  *seen = calloc(count, 1);
+    if (!v || !rec || !seen) { perror("Allocating report"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < count; i++) {
+        if (seen[i]) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s", ops[i].args[2],
+                 (ops[i].rec.flags & TRACE_BUFFERED) ? "(buf)" : "");
+        int n = 0, nfail = 0;
+        for (int j = i; j < count; j++) {
+            if (seen[j] || strcmp(ops[j].args[2], ops[i].args[2]) != 0 ||
+                (ops[j].rec.flags & TRACE_BUFFERED) != (ops[i].rec.flags & TRACE_BUFFERED)) continue;
+            seen[j] = 1;
+            if (failed[j]) { nfail++; continue; }
+            v[n] = latency[j];
+            rec[n] = ops[j].rec.latency;
+            n++;
+        }
+        PrintLatency(name, v, n, nfail, rec);
+    }
 
+    free(v); free(rec); free(seen); free(failed);
+    munmap(latency, count * sizeof(uint64_t) + sizeof(int));
+    return 0;
+}
@@ -0,0 +1,127 @@
+#!/bin/sh
+# Concurrent stress test: N writers and M readers on one image at once,
+# together with workers that delete, rename and duplicate files and a
+# defragmenter. Afterwards every file is read back and compared, and the
+# space counters are recounted with -check.
+#
+#   tests/stress.sh [myfs binary] [writers] [readers] [mixed workers]
+#
+# Exits non-zero on any lost or corrupted file or counter drift.
+set -u
+
+MYFS=${1:-./myfs}
+WRITERS=${2:-24}
+READERS=${3:-24}
+MIXED=${4:-12}
+
+case $MYFS in /*) ;; *) MYFS=$(pwd)/$MYFS ;; esac
+[ -x "$MYFS" ] || { echo "myfs binary not found: $MYFS" >&2; exit 1; }
+
+WORK=$(mktemp -d /tmp/myfs-stress.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+truncate -s 4M disk.img
+"$MYFS" disk.img -format >/dev/null || exit 1
+
+# Source files: sizes from inline up to a few dozen blocks
+i=1
+while [ "$i" -le "$WRITERS" ]; do
+    head -c $(( (i * 7919) % 40000 + 1 )) /dev/urandom > src$i
+    i=$((i + 1))
+done
+
+# Files the mixed workers delete, rename or duplicate while the writers run
+i=1
+while [ "$i" -le "$MIXED" ]; do
+    head -c $(( (i * 6271) % 30000 + 1 )) /dev/urandom > base$i
+    "$MYFS" disk.img -write base$i base$i >/dev/null || exit 1
+    i=$((i + 1))
+done
+
+start=$(date +%s%N)
+
+i=1
+while [ "$i" -le "$WRITERS" ]; do
+    "$MYFS" disk.img -write src$i file$i >/dev/null 2>w$i.err &
+    i=$((i + 1))
+done
+
+# Readers list the root and read whatever has been committed so far; a
+# file that is there must read back complete
+i=1
+while [ "$i" -le "$READERS" ]; do
+    (
+        n=$(( (i % WRITERS) + 1 ))
+        "$MYFS" disk.img -list >/dev/null
+        if "$MYFS" disk.img -read file$n r$i >/dev/null 2>&1; then
+            cmp -s src$n r$i || echo "reader $i: file$n read back corrupted"
+        fi
+    ) > r$i.err 2>&1 &
+    i=$((i + 1))
+done
+
+i=1
+while [ "$i" -le "$MIXED" ]; do
+    case $((i % 3)) in
+        0) "$MYFS" disk.img -delete base$i ;;
+        1) "$MYFS" disk.img -rename base$i moved$i ;;
+        2) "$MYFS" disk.img -duplicate base$i ;;
+    esac >/dev/null 2>m$i.err &
+    i=$((i + 1))
+done
+
+# Defragment moves every block while all of the above run
+( "$MYFS" disk.img -defragment && "$MYFS" disk.img -defragment ) >/dev/null 2>d.err &
+
+wait
+end=$(date +%s%N)
+
+fail=0
+for f in w*.err r*.err m*.err d.err; do
+    if [ -s "$f" ]; then cat "$f"; fail=1; fi
+done
+
+i=1
+bytes=0
+while [ "$i" -le "$WRITERS" ]; do
+    if ! "$MYFS" disk.img -read file$i out >/dev/null 2>&1 || ! cmp -s src$i out; then
+        echo "file$i lost or corrupted"
+        fail=1
+    fi
+    bytes=$((bytes + $(wc -c < src$i)))
+    i=$((i + 1))
+done
+
+# Deleted and renamed-away names are gone; the rest match their source
+i=1
+while [ "$i" -le "$MIXED" ]; do
+    case $((i % 3)) in
+        0) gone=base$i keep= ;;
+        1) gone=base$i keep=moved$i ;;
+        2) gone=       keep="base$i base${i}_copy" ;;
+    esac
+    if [ -n "$gone" ] && "$MYFS" disk.img -read "$gone" out >/dev/null 2>&1; then
+        echo "$gone still there"
+        fail=1
+    fi
+    for f in $keep; do
+        if ! "$MYFS" disk.img -read "$f" out >/dev/null 2>&1 || ! cmp -s base$i out; then
+            echo "$f lost or corrupted"
+            fail=1
+        fi
+    done
+    i=$((i + 1))
+done
+
+check=$("$MYFS" disk.img -check)
+case $check in
+    *" 0 fixed") ;;
+    *) echo "$check"; fail=1 ;;
+esac
+
+ms=$(( (end - start) / 1000000 ))
+[ "$ms" -gt 0 ] || ms=1
+echo "$WRITERS writers + $READERS readers + $MIXED mixed: $bytes bytes in $ms ms ($((bytes / ms)) KB/s)"
+[ "$fail" -eq 0 ] && echo "PASS" || echo "FAIL"
+exit "$fail"